@@ -15,36 +15,293 @@
 //
 
 #include <stdio.h>      // For file i/o, debug printing, etc.
+#include <string.h>     // memcpy, strerror
+#include <errno.h>      // Reporting why metrics and other files could not be written
 #include <sys/stat.h>   // For checking if 'prints' directory exists
 #include <complex.h>    // Complex arithmetic for fractal generation
+#include <math.h>       // Geometric interpolation of zoom between keyframes
 #include <SDL.h>        // For screen rendering
 #include <time.h>       // For naming print files with current time
 #include <cairo.h>      // For generating print images
 #include <cairo-ps.h>   // Postscript printing
 #include <cups/cups.h>  // Printer access
+#include <signal.h>     // Ignoring SIGPIPE from the animation encoder
+#include <fcntl.h>      // Session file and V4L2 camera capture
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>  // V4L2 camera capture
+#include <linux/videodev2.h>
+#define HAVE_V4L2
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // AVX2 / AVX-512 intrinsics for the vectorised iteration kernels
+#define HAVE_X86_KERNELS
+#endif
 
-// Fractal image height and width
-#define W 1920
-#define H 1080
+// Fractal image width and height, chosen at start-up: the size of the
+// display (or --size) times the render scale. Both are even.
+int W = 1920, H = 1080;
+
+// Scaling factors are the size of a pixel in a frame REFERENCE_WIDTH
+// pixels wide, so the view is the same whatever the frame size
+#define REFERENCE_WIDTH 1920
 
 // Fractal image pixels (ARGB)
-Uint32 p[H*W];
+Uint32 *p;
+
+void *simd_alloc(size_t size);
+
+// Template images. Two simple drawn shapes that seed the fractal creation.
+// The size is chosen at start-up; each side must be a power of two (at
+// least 8) so that template coordinates wrap with a mask and a shift.
+int template_w = 1024, template_h = 1024;
+int template_w_bits = 10, template_h_bits = 10; // log2 of the size
+unsigned char *template[2]; // ARGB pixels, template 1 directly follows template 0
+size_t template_bytes;      // size of both templates, 2*4*template_w*template_h
+#define TEMPLATE_PIXEL(n, y, x) (template[n] + 4*((y)*template_w + (x)))
+int template_generation = 0; // incremented whenever a template changes
+
+// Templates updated live from the camera are written to a back buffer of
+// the same layout, which the main loop swaps with the current templates
+// between complete frames, so a frame is never rendered from a mixture.
+unsigned char *template_back;
+SDL_atomic_t template_back_ready; // set when template_back holds new templates
 
-// Template images (including height and width definitions)
-// Two simple drawn shapes that seed the fractal creation
-#define TH 1024
-#define TW 1024
-unsigned char template[2][TH][TW][4]; // ARGB pixels
+// The iteration only needs to know whether the orbit has hit a template,
+// so that is kept in a 1-bit mask per polarity (alpha > 127, or alpha < 127
+// for reverse_template). The mask is stored in tiles of 8x8 texels per
+// 64-bit word, so nearby orbit points tend to share cache lines: the bit
+// for row r = tn*template_h + ty and column tx is bit (r%8)*8 + tx%8 of
+// word (r/8)*(template_w/8) + tx/8. Masks are rebuilt on first use after
+// the templates change.
+Uint64 *template_mask[2];
+int template_mask_generation[2] = {-1, -1};
+
+// Mip-mapped masks, for testing whole areas of a template at once. Level
+// k (from 3 up to the smaller of template_w_bits and template_h_bits) has
+// a byte per block of 2^k x 2^k texels, nonzero if any texel of the block
+// is in the mask. Blocks are in rows like the texels, level after level.
+// Level 3 is read straight off the mask words. Rebuilt with the masks.
+unsigned char *template_mip[2];
+
+// Signed distance field of each mask, laid out like the texels: the
+// Euclidean distance in texels from each texel to the nearest texel of the
+// other kind, negative for texels in the mask (which the orbit hits) and
+// positive for those outside it, up to DISTANCE_RANGE texels either way.
+// Colour mode 4 uses it to shade by how deep the orbit went into the
+// template shape. Rebuilt on first use after the templates change.
+#define DISTANCE_RANGE 8
+float *template_distance[2];
+int template_distance_generation[2] = {-1, -1};
 
 // Function prototypes
-void print_card(int print_hard_copy);
+void print_card(int print_hard_copy, double px, complex double centre, complex double centre_lo,
+        complex double a, complex double b, complex double c, complex double d,
+        int cmode, int invert_colour, int reverse_template);
+extern int print_width, print_aa;
+void print_status();
+void stop_printer();
 
-void generate_fractal (
-        Uint32 *p, int w, int h, double px, complex double centre,
+int generate_fractal (
+        Uint32 *p, int w, int h, double px, complex double centre, complex double centre_lo,
         complex double a, complex double b, complex double c, complex double d,
-        int cmode, int invert_colour, int reverse_template );
+        int cmode, int invert_colour, int reverse_template, Uint32 deadline );
+
+// Return values of generate_fractal()
+#define FRAME_PARTIAL   0 // frame still in progress
+#define FRAME_COMPLETE  1 // frame finished
+#define FRAME_UNCHANGED 2 // p already held this frame, nothing was done
+
+// Progressive rendering: a frame that does not finish before its deadline
+// is resumed by the next call. Each frame interval (in ms) the main loop
+// presents whatever has been rendered so far.
+#define FRAME_INTERVAL 16
+#define MAX_PREVIEW_LEVEL 3 // coarsest preview has one sample per 8x8 pixels
+struct
+{
+    int complete;   // frames finished
+    int cached;     // frames copied from the frame cache
+    int partial;    // frame intervals that ended with the frame unfinished
+    int abandoned;  // unfinished frames discarded because the parameters changed
+    int reprojected; // frames started from the previous frame zoomed or panned to the new view
+    Uint32 render_time; // total time from start to completion of finished frames
+} frame_stats;
+
+// Everything that determines the iteration results of a frame. The
+// colour mode and inversion are not included because they only affect
+// the shading of those results.
+typedef struct
+{
+    int w, h;
+    double px;
+    complex double centre, centre_lo, a, b, c, d;
+    int reverse_template;
+    int template_generation;
+    int aa;
+    int max_iterations, detect_cycles;
+} frame_key;
+
+// Adaptive anti-aliasing: once a frame is complete, pixels on edges get
+// aa_samples x aa_samples samples (1 = off, at most 4)
+int aa_samples = 1;
+
+// Orbits that have not hit a template after max_iterations iterations are
+// left unresolved with n = max_iterations. With detect_cycles, orbits that
+// settle into a cycle (period 1 for a fixed point) stop early instead and
+// get n = max_iterations + period. Nothing after the cycle can hit the
+// template, so only colour mode 5 tells them apart from unresolved orbits.
+#define MAX_ITERATIONS 1000
+int max_iterations = 25;
+int detect_cycles = 1;
+
+// Iteration results of a whole frame: for every pixel the iteration count
+// and the template texel (tn*template_h + ty)*template_w + tx where the orbit stopped
+typedef struct
+{
+    Uint16 *n;
+    Uint32 *texel;
+    
+    // Edge pixels supersampled for anti-aliasing, each with aa x aa
+    // samples in rows (see find_edges)
+    int edges, aa;
+    Uint32 *edge;              // pixel index of each
+    Uint16 *edge_n;
+    Uint32 *edge_texel;
+    int edge_space, sample_space; // allocated entries
+} iteration_buffer;
+iteration_buffer last_frame; // iteration results of the last completed frame
+
+// Recently completed frames, so that flipping back to earlier parameters
+// (function mode, template polarity...) does not re-iterate them
+#define FRAME_CACHE_SIZE 6 // entries hold 6 bytes per pixel (n and texel), so 6 take about the memory of 8 ARGB frames
+struct
+{
+    frame_key key;
+    iteration_buffer it;
+    Uint32 last_used;
+} frame_cache[FRAME_CACHE_SIZE];
 
+int set_template_size(int w, int h);
+const Uint64 *get_template_mask(int reverse_template);
+const unsigned char *get_template_mip(int reverse_template);
+const float *get_template_distance(int reverse_template);
+void swap_templates(int n);
+void flat_templates();
 void update_template(SDL_Renderer *sdlRenderer);
+extern const char *camera_source;
+extern int live_template;
+void set_live_template(int n);
+int live_template_ready();
+int load_template(int n, const char *filename);
+void save_templates();
+
+// The view kept in the session file with the templates (see open_session)
+typedef struct
+{
+    double scaling_factor;
+    complex double centre, centre_lo, mouse_c;
+    Sint32 hold_c, invert_colour, reverse_template, colour_mode, function_mode;
+} session_view;
+int open_session(const char *filename, session_view *view);
+void save_view(const session_view *view);
+void store_templates();
+void recall_templates();
+void close_session(const session_view *view);
+
+void set_function(int function_mode, complex double c,
+        complex double *a, complex double *b, complex double *cc, complex double *d);
+
+// Settings for headless batch rendering. Frames are rendered for a single
+// value of c, a path of c values from c to c_end, or a grid of c values
+// spanning the rectangle between c and c_end.
+typedef struct
+{
+    int function_mode, colour_mode, invert_colour, reverse_template;
+    double scaling_factor;
+    complex double c, c_end;
+    int nx, ny;          // number of c values along the path or grid (ny is 0 for a path)
+    const char *output;  // file name pattern with one printf integer conversion for the frame number; .png or .ppm
+} batch_settings;
+int run_batch(const batch_settings *batch);
+int run_benchmark(int repeat, int have_templates);
+
+// Animation export: frames interpolated between keyframes, streamed as raw
+// video to an encoder command (by default ffmpeg writing to video_file)
+typedef struct
+{
+    const char *keyframe_file;
+    double fps;
+    const char *video_file;
+    const char *encoder;
+} animation_settings;
+int run_animation(const batch_settings *batch, const animation_settings *animation);
+
+// Thread pool used to render the fractal in tiles (bands of rows)
+#define TILE_ROWS 8
+#define MAX_THREADS 64
+typedef void (*tile_function)(void *job, int tile, int thread);
+void parallel_tiles(tile_function fn, void *job, int ntiles);
+void background_tiles(tile_function fn, void *job, int ntiles);
+void serial_tiles(tile_function fn, void *job, int ntiles);
+void interleave_tiles(int *order, int ntiles);
+void print_thread_stats();
+
+// Iteration kernels (scalar, AVX2, AVX-512), selected at run time
+int select_kernel(const char *name);
+int validate_kernels();
+
+// Deep zooms: frames are iterated by perturbation when adjacent pixels
+// differ by less than DEEP_ZOOM_PX relative to z^2 + 1 (see deep_zoom),
+// and zooming stops at scaling factors of DEEP_ZOOM_LIMIT relative to
+// |centre| + 1, where double-double centres run out of precision
+#define DEEP_ZOOM_PX 1e-10
+#define DEEP_ZOOM_LIMIT 1e-28
+#define DEEP_ZOOM_GLITCH 1e-6 // see iterate_pixel_deep
+void pan_centre(complex double *centre, complex double *centre_lo, complex double step);
+
+// Metrics for an installation that runs for days: the time taken by each
+// stage of the pipeline and how the orbits of completed frames ended,
+// shown over the fractal with the "h" key and written every 10 seconds to
+// the file given with --metrics. Every counter has a single writer, the
+// thread that runs its stage, so none of them needs a lock.
+enum {METRIC_ITERATE, METRIC_SHADE, METRIC_UPLOAD, METRIC_PRESENT,
+      METRIC_CAPTURE, METRIC_SEGMENT, METRIC_PRINT, METRIC_STAGES};
+
+// How orbits ended: on the template (n < max_iterations), unresolved
+// (n = max_iterations), at a fixed point, which includes orbits trapped
+// where they can never reach the template (n = max_iterations + 1), or
+// in a longer cycle
+enum {BREAK_HIT, BREAK_LIMIT, BREAK_FIXED, BREAK_CYCLE, BREAK_REASONS};
+
+typedef struct
+{
+    Uint64 count;            // times the stage ran
+    Uint64 ticks, max_ticks; // performance counter ticks, in total and the longest run
+} stage_timer;
+
+struct
+{
+    int enabled;      // count the pixels of completed frames (HUD shown or file given)
+    const char *file; // --metrics output, or NULL
+    stage_timer stage[METRIC_STAGES];
+    Uint64 frames;    // completed frames counted
+    
+    // Per pool thread, on separate cache lines: iteration counts of the
+    // pixels of completed frames and the reasons their orbits ended
+    struct
+    {
+        Uint64 histogram[2*MAX_ITERATIONS + 1];
+        Uint64 breaks[BREAK_REASONS];
+        char padding[64];
+    } thread[MAX_THREADS];
+} metrics;
+
+void record_stage(int stage, Uint64 start);
+void count_frame(const iteration_buffer *it, int w, int h);
+void write_metrics();
+int update_hud(SDL_Renderer *renderer, int show);
+void draw_hud(SDL_Renderer *renderer);
 
 // Main function
 int main(int argc, char *argv[])
@@ -53,381 +310,5102 @@ int main(int argc, char *argv[])
     complex double a, b, c, d;
     
     double scaling_factor = 0.005;
+    complex double centre = 0;    // point of the plane at the centre of the frame
+    complex double centre_lo = 0; // and its low part, for deep zooms
+    complex double mouse_c = 0;   // c as set by the mouse
+    int hold_c = 0;               // keep c while zooming and panning
     int invert_colour = 0;
     int reverse_template = 0;
-    int colour_mode = 0, colour_modes = 5;
+    int colour_mode = 0, colour_modes = 6;
     int function_mode = 0, function_modes = 4;
 
     int exiting = 0;
+    int show_hud = 0, hud_changed;
+    
+    const char *kernel = NULL;
+    int size_w = 0, size_h = 0;   // output size, or 0 to match the display
+    double render_scale = 1;      // frame size relative to the output size
+    int headless = 0, benchmark = 0, validate = 0;
+    int template_size_w = 1024, template_size_h = 1024;
+    const char *template_file[2] = {NULL, NULL};
+    const char *session_file = "fraktalismus.session";
+    session_view view;
+    batch_settings batch = {0, 0, 0, 0, 0.005, 0, 0, 1, 0, "frame_%05d.ppm"};
+    animation_settings animation = {NULL, 25, "fraktalismus.mp4", NULL};
+    double re, im, re_end, im_end;
+    
+    // Command line options
+    for (x=1 ; x<argc ; ++x)
+    {
+        if (strcmp(argv[x], "--kernel") == 0 && x+1 < argc) kernel = argv[++x];
+        else if (strcmp(argv[x], "--validate-kernels") == 0) validate = 1;
+        else if (strcmp(argv[x], "--template-size") == 0 && x+1 < argc
+                && sscanf(argv[++x], "%dx%d", &template_size_w, &template_size_h) == 2) {}
+        else if (strcmp(argv[x], "--size") == 0 && x+1 < argc
+                && sscanf(argv[++x], "%dx%d", &size_w, &size_h) == 2 && size_w >= 16 && size_h >= 16) {}
+        else if (strcmp(argv[x], "--render-scale") == 0 && x+1 < argc
+                && (render_scale = atof(argv[++x])) >= 0.1 && render_scale <= 4) {}
+        else if (strcmp(argv[x], "--headless") == 0) headless = 1;
+        else if (strcmp(argv[x], "--benchmark") == 0) benchmark = 10;
+        else if (strcmp(argv[x], "--repeat") == 0 && x+1 < argc) benchmark = atoi(argv[++x]);
+        else if (strcmp(argv[x], "--mode") == 0 && x+1 < argc) batch.function_mode = atoi(argv[++x]) % function_modes;
+        else if (strcmp(argv[x], "--colour") == 0 && x+1 < argc) batch.colour_mode = atoi(argv[++x]) % colour_modes;
+        else if (strcmp(argv[x], "--scale") == 0 && x+1 < argc) batch.scaling_factor = atof(argv[++x]);
+        else if (strcmp(argv[x], "--invert") == 0) batch.invert_colour = 1;
+        else if (strcmp(argv[x], "--reverse") == 0) batch.reverse_template = 1;
+        else if (strcmp(argv[x], "--template1") == 0 && x+1 < argc) template_file[0] = argv[++x];
+        else if (strcmp(argv[x], "--template2") == 0 && x+1 < argc) template_file[1] = argv[++x];
+        else if (strcmp(argv[x], "--session") == 0 && x+1 < argc) session_file = argv[++x];
+        else if (strcmp(argv[x], "--no-session") == 0) session_file = NULL;
+        else if (strcmp(argv[x], "--output") == 0 && x+1 < argc) batch.output = argv[++x];
+        else if (strcmp(argv[x], "--animate") == 0 && x+1 < argc) animation.keyframe_file = argv[++x];
+        else if (strcmp(argv[x], "--fps") == 0 && x+1 < argc && (animation.fps = atof(argv[++x])) > 0) {}
+        else if (strcmp(argv[x], "--video") == 0 && x+1 < argc) animation.video_file = argv[++x];
+        else if (strcmp(argv[x], "--encoder") == 0 && x+1 < argc) animation.encoder = argv[++x];
+        else if (strcmp(argv[x], "--camera") == 0 && x+1 < argc) camera_source = argv[++x];
+        else if (strcmp(argv[x], "--aa") == 0 && x+1 < argc && (aa_samples = atoi(argv[++x])) >= 1 && aa_samples <= 4) {}
+        else if (strcmp(argv[x], "--iterations") == 0 && x+1 < argc
+                && (max_iterations = atoi(argv[++x])) >= 25 && max_iterations <= MAX_ITERATIONS) {}
+        else if (strcmp(argv[x], "--no-cycles") == 0) detect_cycles = 0;
+        else if (strcmp(argv[x], "--metrics") == 0 && x+1 < argc) metrics.file = argv[++x];
+        else if (strcmp(argv[x], "--print-width") == 0 && x+1 < argc && (print_width = atoi(argv[++x])) >= 16) {}
+        else if (strcmp(argv[x], "--print-aa") == 0 && x+1 < argc && (print_aa = atoi(argv[++x])) >= 1 && print_aa <= 8) {}
+        else if (strcmp(argv[x], "--c") == 0 && x+1 < argc && sscanf(argv[++x], "%lf,%lf", &re, &im) == 2)
+        {
+            batch.c = batch.c_end = re + im*I;
+        }
+        else if (strcmp(argv[x], "--path") == 0 && x+1 < argc
+                && sscanf(argv[++x], "%lf,%lf,%lf,%lf,%d", &re, &im, &re_end, &im_end, &batch.nx) == 5)
+        {
+            batch.c = re + im*I; batch.c_end = re_end + im_end*I; batch.ny = 0;
+        }
+        else if (strcmp(argv[x], "--grid") == 0 && x+1 < argc
+                && sscanf(argv[++x], "%lf,%lf,%lf,%lf,%d,%d", &re, &im, &re_end, &im_end, &batch.nx, &batch.ny) == 6)
+        {
+            batch.c = re + im*I; batch.c_end = re_end + im_end*I;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--kernel scalar|avx2|avx512] [--validate-kernels] [--benchmark [--repeat N]]\n"
+                    "       [--size WxH] [--render-scale S]\n"
+                    "       [--headless] [--mode N] [--colour N] [--scale S] [--invert] [--reverse]\n"
+                    "       [--template-size WxH] [--template1 FILE.png] [--template2 FILE.png] [--session FILE | --no-session]\n"
+                    "       [--output PATTERN.png|.ppm] [--camera DEVICE|ffmpeg:DEVICE|FILE]\n"
+                    "       [--animate KEYFRAMES [--fps N] [--video FILE | --encoder COMMAND]]\n"
+                    "       [--aa N] [--iterations N] [--no-cycles] [--print-width PIXELS] [--print-aa N] [--metrics FILE]\n"
+                    "       [--c RE,IM | --path RE0,IM0,RE1,IM1,N | --grid RE0,IM0,RE1,IM1,NX,NY]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (select_kernel(kernel) < 0) exit(1);
+    metrics.enabled = metrics.file != NULL;
+    if (set_template_size(template_size_w, template_size_h) < 0) exit(1);
+    
+    // Headless frames are rendered at the given size, or 1920x1080
+    if (size_w > 0)
+    {
+        W = size_w & ~1;
+        H = size_h & ~1;
+    }
+    if (validate) return validate_kernels();
+    
+    // Initialise templates with flat colours
+    flat_templates();
+    
+    // The interactive mode carries on with the view and templates of the
+    // last session
+    if (!benchmark && !headless && !animation.keyframe_file && session_file && open_session(session_file, &view) == 1)
+    {
+        if (view.scaling_factor > 0 && isfinite(view.scaling_factor)) scaling_factor = view.scaling_factor;
+        centre = view.centre;
+        centre_lo = view.centre_lo;
+        mouse_c = view.mouse_c;
+        hold_c = view.hold_c != 0;
+        invert_colour = view.invert_colour != 0;
+        reverse_template = view.reverse_template != 0;
+        colour_mode = (unsigned)view.colour_mode % colour_modes;
+        function_mode = (unsigned)view.function_mode % function_modes;
+    }
+    
+    // Load template images given on the command line
+    for (x=0 ; x<2 ; ++x) if (template_file[x] && load_template(x, template_file[x]) < 0) exit(1);
+    store_templates();
+    
+    // Benchmark the renderer over a fixed set of scenes
+    if (benchmark > 0) return run_benchmark(benchmark, template_file[0] || template_file[1]);
+    
+    // In headless mode, render the requested frames to files without opening a window
+    if (animation.keyframe_file) return run_animation(&batch, &animation);
+    if (headless) return run_batch(&batch);
+    
+    // Initialise SDL
+    if (SDL_Init(SDL_INIT_EVERYTHING) == -1)
+    {
+        fprintf(stderr, "Failed to initialise SDL\n");
+        exit(1);
+    }
+    
+    // Set up display. If a second screen is attached, use that.
+    // Otherwise, use the main screen.
+    int display_number = 0;
+    if (SDL_GetNumVideoDisplays() > 1) display_number = 1;
+    SDL_Rect displayRect;
+    SDL_GetDisplayBounds(display_number, &displayRect);
+    printf("Display %d: x=%d, y=%d, w=%d, h=%d\n", display_number, displayRect.x, displayRect.y, displayRect.w, displayRect.h);
+    
+    // Size the frame to the output (the display unless --size was given)
+    // times the render scale
+    if (size_w == 0)
+    {
+        size_w = displayRect.w;
+        size_h = displayRect.h;
+    }
+    W = (int)(size_w*render_scale + 0.5) & ~1;
+    H = (int)(size_h*render_scale + 0.5) & ~1;
+    if (W < 16) W = 16;
+    if (H < 16) H = 16;
+    p = simd_alloc(W*H*sizeof(Uint32));
+    memset(p, 0, W*H*sizeof(Uint32));
+    printf("Output %d x %d, rendering %d x %d\n", size_w, size_h, W, H);
+    
+    // Create SDL window and renderer
+    SDL_Window *sdlWindow;
+    SDL_Renderer *sdlRenderer;
+    sdlWindow = SDL_CreateWindow("Fraktalismus Window", displayRect.x, displayRect.y, displayRect.w, displayRect.h, SDL_WINDOW_FULLSCREEN_DESKTOP);
+    if (W != size_w || H != size_h) SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    sdlRenderer = SDL_CreateRenderer(sdlWindow, 0, SDL_RENDERER_PRESENTVSYNC);
+    SDL_RenderSetLogicalSize(sdlRenderer, size_w, size_h); // letterbox if --size has another aspect ratio
+    
+    // The mouse sets c in the same range for any window size
+    int window_w, window_h;
+    SDL_GetWindowSize(sdlWindow, &window_w, &window_h);
+    
+    // Clear the new window
+    SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 255);
+    SDL_RenderClear(sdlRenderer);
+    SDL_RenderPresent(sdlRenderer);
+    
+    // Create texture for frame
+    SDL_Texture *sdlTexture;
+    sdlTexture = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, W, H);
+    
+    // Initialise time for frame deadlines and statistics
+    Uint32 frame_start, stats_time;
+    Uint64 stage_start;
+    stats_time = SDL_GetTicks();
+    
+    SDL_Event event;
+    int frame_status = FRAME_PARTIAL;
+    set_function(function_mode, 0, &a, &b, &c, &d);
+    while (!exiting)
+    {
+        // When the frame on screen is up to date, sleep until there is input
+        // (or new live templates)
+        if (frame_status == FRAME_UNCHANGED) SDL_WaitEventTimeout(NULL, live_template >= 0 ? FRAME_INTERVAL : 100);
+        
+        // Process any pending user input events
+        while (!exiting && SDL_PollEvent(&event))
+        {
+            if (event.type == SDL_KEYDOWN)
+            {
+                // With shift, the arrow keys pan by an eighth of the frame width
+                if (event.key.keysym.mod & KMOD_SHIFT && event.key.keysym.sym == SDLK_LEFT) pan_centre(&centre, &centre_lo, -scaling_factor * REFERENCE_WIDTH / 8);
+                else if (event.key.keysym.mod & KMOD_SHIFT && event.key.keysym.sym == SDLK_RIGHT) pan_centre(&centre, &centre_lo, scaling_factor * REFERENCE_WIDTH / 8);
+                else if (event.key.keysym.mod & KMOD_SHIFT && event.key.keysym.sym == SDLK_UP) pan_centre(&centre, &centre_lo, -scaling_factor * REFERENCE_WIDTH / 8 * I);
+                else if (event.key.keysym.mod & KMOD_SHIFT && event.key.keysym.sym == SDLK_DOWN) pan_centre(&centre, &centre_lo, scaling_factor * REFERENCE_WIDTH / 8 * I);
+                else if (event.key.keysym.sym == SDLK_UP) {if (scaling_factor > DEEP_ZOOM_LIMIT * (1 + cabs(centre))) scaling_factor /= 1.1;}
+                else if (event.key.keysym.sym == SDLK_DOWN) scaling_factor *= 1.1;
+                else if (event.key.keysym.sym == SDLK_HOME) {centre = centre_lo = 0; scaling_factor = 0.005;}
+                else if (event.key.keysym.sym == SDLK_k) {hold_c = !hold_c; printf("%s c\n", hold_c ? "Holding" : "Releasing");}
+                else if (event.key.keysym.sym == SDLK_ESCAPE) exiting = 1;
+                else if (event.key.keysym.sym == SDLK_p) print_card(1, scaling_factor * REFERENCE_WIDTH / W, centre, centre_lo, a, b, c, d, colour_mode, invert_colour, reverse_template); // Print hard copy
+                else if (event.key.keysym.sym == SDLK_s) print_card(0, scaling_factor * REFERENCE_WIDTH / W, centre, centre_lo, a, b, c, d, colour_mode, invert_colour, reverse_template); // Only print to file
+                else if (event.key.keysym.sym == SDLK_i) invert_colour = 1 - invert_colour;
+                else if (event.key.keysym.sym == SDLK_r) reverse_template = 1 - reverse_template;
+                else if (event.key.keysym.sym == SDLK_q) exiting = 1;
+                else if (event.key.keysym.sym == SDLK_c) {colour_mode = (colour_mode + 1) % colour_modes; printf("Colour mode: %d\n", colour_mode);}
+                else if (event.key.keysym.sym == SDLK_f) {function_mode = (function_mode + 1) % function_modes; printf("Function mode: %d\n", function_mode);}
+                else if (event.key.keysym.sym == SDLK_u) {set_live_template(-1); update_template(sdlRenderer); store_templates();}
+                else if (event.key.keysym.sym == SDLK_b) recall_templates();
+                else if (event.key.keysym.sym == SDLK_w) save_templates();
+                else if (event.key.keysym.sym == SDLK_l) set_live_template(live_template < 1 ? live_template + 1 : -1);
+                else if (event.key.keysym.sym == SDLK_t) print_thread_stats();
+                else if (event.key.keysym.sym == SDLK_h) {show_hud = !show_hud; metrics.enabled = show_hud || metrics.file;}
+                else if (event.key.keysym.sym == SDLK_a) {aa_samples = aa_samples < 4 ? 2*aa_samples : 1; printf("Anti-aliasing: %d x %d samples on edges\n", aa_samples, aa_samples);}
+            }
+        }
+        
+        // Get mouse position. While c is held, zooming and panning only
+        // change the view, so each frame can start from the last one.
+        if (!hold_c)
+        {
+            SDL_GetMouseState(&x, &y);
+            mouse_c = scaling_factor * REFERENCE_WIDTH / window_w * ((x - window_w/2) + (y - window_h/2)*I);
+        }
+        set_function(function_mode, mouse_c, &a, &b, &c, &d);
+        
+        // Swap in new live templates, but never part way through a frame
+        if (live_template >= 0 && frame_status != FRAME_PARTIAL && live_template_ready())
+        {
+            swap_templates(live_template);
+            SDL_AtomicSet(&template_back_ready, 0);
+        }
+        
+        // Generate fractal, or as much of it as fits in this frame interval
+        frame_start = SDL_GetTicks();
+        frame_status = generate_fractal(p, W, H, scaling_factor * REFERENCE_WIDTH / W, centre, centre_lo, a, b, c, d, colour_mode, invert_colour, reverse_template,
+                frame_start + 3*FRAME_INTERVAL/4);
+        
+        // Draw fractal image, with the HUD over it
+        hud_changed = update_hud(sdlRenderer, show_hud);
+        if (hud_changed || frame_status != FRAME_UNCHANGED)
+        {
+            if (frame_status != FRAME_UNCHANGED)
+            {
+                stage_start = SDL_GetPerformanceCounter();
+                SDL_UpdateTexture(sdlTexture, NULL, p, W * sizeof(Uint32));
+                record_stage(METRIC_UPLOAD, stage_start);
+            }
+            stage_start = SDL_GetPerformanceCounter();
+            SDL_RenderClear(sdlRenderer);
+            SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, NULL);
+            draw_hud(sdlRenderer);
+            SDL_RenderPresent(sdlRenderer);
+            record_stage(METRIC_PRESENT, stage_start);
+        }
+        
+        // Report finished print jobs
+        print_status();
+        
+        // Print frame statistics every 10 seconds
+        if (SDL_GetTicks() - stats_time >= 10000)
+        {
+            printf("Frames: %d complete (average %d ms), %d cached, %d reprojected, %d partial, %d abandoned\n",
+                    frame_stats.complete, frame_stats.complete ? frame_stats.render_time / frame_stats.complete : 0,
+                    frame_stats.cached, frame_stats.reprojected, frame_stats.partial, frame_stats.abandoned);
+            memset(&frame_stats, 0, sizeof(frame_stats));
+            stats_time = SDL_GetTicks();
+            if (metrics.file) write_metrics();
+            
+            // Keep the session up to date, but leave live templates out
+            // of the history until live updates stop
+            view = (session_view){scaling_factor, centre, centre_lo, mouse_c, hold_c, invert_colour, reverse_template, colour_mode, function_mode};
+            save_view(&view);
+            if (live_template < 0) store_templates();
+        }
+    }
+    if (metrics.file) write_metrics();
+    
+    // Stop live template updates and finish any print jobs
+    if (live_template >= 0) set_live_template(-1);
+    stop_printer();
+    
+    // Save the session for the next start
+    view = (session_view){scaling_factor, centre, centre_lo, mouse_c, hold_c, invert_colour, reverse_template, colour_mode, function_mode};
+    close_session(&view);
+    
+    // Destroy SDL objects
+    SDL_DestroyTexture(sdlTexture);
+    SDL_DestroyRenderer(sdlRenderer);
+    SDL_DestroyWindow(sdlWindow);
+    free(p);
+
+    // Close SDL
+    SDL_Quit();
+    
+    return 0;
+}
+
+// Double-double numbers: the unevaluated sum hi + lo of two doubles, with
+// lo at most half an ulp of hi, for about 32 significant digits
+typedef struct
+{
+    double hi, lo;
+} dd_real;
+
+typedef struct
+{
+    dd_real re, im;
+} dd_complex;
+
+// Reference orbit of a deep zoom frame, computed in double-double from a
+// point near the centre (see iterate_pixel_deep)
+typedef struct
+{
+    // Frame and function it was computed for
+    int w, iterations;
+    double px;
+    complex double centre, centre_lo, a, b, c, d;
+    
+    complex double offset;    // its starting point less the centre of the frame
+    int length;               // z_n is finite for n < length (at most max_iterations + 1)
+    dd_complex *z;            // z_n, n = 0 to max_iterations
+    complex double *zd;       // z_n rounded to double
+    complex double *den;      // b z_n^2 + d rounded to double
+} reference_orbit;
+
+// Parameters shared by all tiles of one fractal frame
+typedef struct
+{
+    Uint32 *p;          // shaded pixels
+    iteration_buffer it; // iteration results
+    int w, h;
+    double px;
+    complex double centre, a, b, c, d;
+    int cmode, invert_colour, reverse_template;
+    const Uint64 *mask; // template alpha mask for reverse_template
+    const unsigned char *mip; // and its mip levels (NULL to do without)
+    const float *distance; // and its distance field, for colour mode 4 (or NULL)
+    
+    // The centre in double-double is centre + centre_lo. When the frame is
+    // zoomed in beyond the precision of double, deep is its reference orbit
+    // and it is iterated by perturbation (see prepare_deep_zoom).
+    complex double centre_lo;
+    const reference_orbit *deep;
+    
+    // With symmetric set, only rows 0 to h/2 are iterated and the rest of
+    // the frame is mirrored from them (see frame_symmetric). rows is the
+    // number of rows iterated.
+    int symmetric, rows;
+    
+    // Progress of the frame. It is rendered in passes, starting with one
+    // sample per 2^first_level x 2^first_level block of pixels and halving
+    // the spacing each pass until every pixel has been computed.
+    int first_level, level;
+    int reprojected;          // started from the previous frame, so the first pass may be interrupted
+    int *band;                // band of rows iterated by each tile, from the centre of the frame out
+    // After the last pass (level 0), the anti-aliasing pass (level -1)
+    // supersamples the edge pixels in chunks of EDGE_CHUNK per tile.
+    Uint32 deadline;          // tiles are not started after this time (0 = no limit)
+    unsigned char *tile_done; // one flag per tile
+    SDL_atomic_t tiles_done;
+    int shade_all_edges;      // every edge chunk is done, whatever tile_done says
+} fractal_job;
+
+// A row kernel iterates count pixels of row y, starting at x0 and spaced
+// step pixels apart, storing for each the iteration count n and the
+// template texel (tn*template_h + ty)*template_w + tx where it stopped.
+typedef void (*row_kernel)(const fractal_job *f, int y, int x0, int step, int count, int *n, Uint32 *texel);
+
+row_kernel iterate_row = NULL;
+
+// Test the template alpha mask bit for template row r = tn*template_h + ty
+static inline int template_hit(const Uint64 *mask, Uint32 r, Uint32 tx)
+{
+    return (mask[((r >> 3) << (template_w_bits - 3)) + (tx >> 3)] >> (((r & 7) << 3) + (tx & 7))) & 1;
+}
+
+// Result of an orbit found to cycle at iteration n with the given period:
+// the texel of the last iteration, max_iterations-1, which the orbit would
+// have reached, taken from the texels of earlier iterations
+static inline int cycle_result(const Uint32 *history, int lanes, int lane, int n, int period, Uint32 *texel)
+{
+    int m = n - period;
+    *texel = history[(m + (max_iterations-1 - m) % period)*lanes + lane];
+    return max_iterations + period;
+}
+
+// An orbit can be shown never to hit the template once it is trapped near
+// an attracting fixed point. Let D be the disc of radius r = 4|f(z) - z|
+// about z. Where |f'| < 3/4 throughout D, f maps D into itself, so the
+// orbit stays in D, and if D covers no texel in the mask it never hits.
+// On D, |f'(w)| = 2|w||ad - bc|/|bw^2 + d|^2 with |bw^2 + d| >= |bz^2 + d| -
+// |b|r(2|z| + r). The bounds are tightened (|f'| < 0.7, a minimum r and a
+// margin of 2 texels) to cover rounding and the truncation of template
+// coordinates. Trapped orbits are counted as fixed points.
+//
+// The first test, that f contracts D, is made from z, zn = f(z) and den =
+// bz^2 + d, which the kernels have anyway, and the vectorised kernels
+// repeat it operation for operation. It sets the radius r of D.
+static inline int orbit_contracts(const fractal_job *f, complex double z, complex double zn, complex double den, double *r)
+{
+    double dr = creal(zn) - creal(z), di = cimag(zn) - cimag(z);
+    double abs_z = sqrt(creal(z)*creal(z) + cimag(z)*cimag(z)), lo;
+    
+    *r = 4*sqrt(dr*dr + di*di) + 1e-9*(1 + abs_z);
+    lo = sqrt(creal(den)*creal(den) + cimag(den)*cimag(den)) - cabs(f->b)*(*r)*(2*abs_z + *r);
+    return lo > 0 && 2*(abs_z + *r)*cabs(f->a*f->d - f->b*f->c) < 0.7*lo*lo;
+}
+
+// The second test, that the disc of radius r about z covers no texel in
+// the mask, for orbits that pass the first. The texels within R of the
+// centre are covered by a few blocks of a mip level with blocks at least R
+// across, and none of those may have a texel in the mask. Only inlined
+// into the two functions below, so that every kernel makes the same
+// decision (gcc would contract its arithmetic into FMAs inside the AVX-512
+// kernel).
+__attribute__((always_inline))
+static inline int disc_misses_template_body(const fractal_job *f, complex double z, double r)
+{
+    double cx, cy, R;
+    Uint32 x0, x1, y0, y1, tx, ty, tn;
+    int k, top, bx, by, bx0, bx1, by0, by1, cols, rows;
+    const unsigned char *level = f->mip;
+    
+    if (level == NULL) return 0;
+    
+    // The disc in template coordinates must lie within one tile
+    cx = template_w*(0.5 + 0.25*creal(z));
+    cy = template_h*(0.5 + 0.25*cimag(z));
+    R = 0.25*r*(template_w > template_h ? template_w : template_h) + 2;
+    if (!(fabs(cx) + R < 1e9 && fabs(cy) + R < 1e9)) return 0;
+    x0 = (Sint64)(cx - R); x1 = (Sint64)(cx + R);
+    y0 = (Sint64)(cy - R); y1 = (Sint64)(cy + R);
+    if ((x0 >> template_w_bits) != (x1 >> template_w_bits) || (y0 >> template_h_bits) != (y1 >> template_h_bits)) return 0;
+    
+    // The template is not tested in the central tile
+    if ((x0 >> template_w_bits) == 0 && (y0 >> template_h_bits) == 0) return 1;
+    tx = (Uint32)(Sint64)cx & (template_w-1);
+    ty = (Uint32)(Sint64)cy & (template_h-1);
+    tn = ((x0 >> template_w_bits) + (y0 >> template_h_bits)) % 2;
+    
+    top = template_w_bits < template_h_bits ? template_w_bits : template_h_bits;
+    for (k=3 ; (1 << k) < R && k < top ; ++k) level += (2*template_h >> k)*(template_w >> k);
+    cols = template_w >> k;
+    rows = template_h >> k;
+    bx0 = tx < R ? 0 : (int)(tx - R) >> k;
+    bx1 = tx + R >= template_w ? cols - 1 : (int)(tx + R) >> k;
+    by0 = ty < R ? 0 : (int)(ty - R) >> k;
+    by1 = ty + R >= template_h ? rows - 1 : (int)(ty + R) >> k;
+    for (by=by0 ; by<=by1 ; ++by) for (bx=bx0 ; bx<=bx1 ; ++bx)
+        if (level[(tn*rows + by)*cols + bx]) return 0;
+    return 1;
+}
+
+__attribute__((noinline))
+static int disc_misses_template(const fractal_job *f, complex double z, double r)
+{
+    return disc_misses_template_body(f, z, r);
+}
+
+// The same for the vectorised kernels. Called from them, SSE code would
+// run with the upper halves of the vector registers dirty (gcc keeps values
+// live there across the call, so cannot clear them), which costs more than
+// the rest of the test. AVX2 alone does not enable FMAs.
+__attribute__((noinline, target("avx2")))
+static int disc_misses_template_avx2(const fractal_job *f, complex double z, double r)
+{
+    return disc_misses_template_body(f, z, r);
+}
+
+// Iterate a single pixel. This is the reference implementation that the
+// vectorised kernels must reproduce.
+//
+// Cycles are detected with Brent's method: z is saved at iterations 2, 4,
+// 8, ... and compared with every later iteration until the next save.
+// Fixed points are also caught as soon as z repeats the previous
+// iteration. Comparisons are bitwise, so a repeat means the orbit is
+// exactly periodic from there on. An orbit that overflows to NaN is taken
+// to be at a fixed point, as NaNs never hit the template (and whether
+// they compare bitwise equal depends on how the arithmetic was compiled).
+// Iterations 0 and 1 are never saved because the template is not tested
+// there. At each save the orbit is also tested for being trapped near an
+// attracting fixed point.
+int iterate_pixel(const fractal_job *f, int x, int y, Uint32 *texel)
+{
+    int n, s = 0, w = f->w, h = f->h;
+    complex double z, zz, zn, den, last = 0, saved = 0;
+    double r;
+    Uint32 tx = 0, ty = 0, tn = 0, txx, tyy;
+    Uint32 history[max_iterations];
+    
+    z = f->centre + f->px * ((x-w/2) + I*(y-h/2));
+    
+    for (n=0 ; n<max_iterations ; ++n)
+    {
+        // Find template coordinates
+        txx = template_w*(0.5 + 0.25*creal(z));
+        tx = txx & (template_w-1);
+        tyy = template_h*(0.5 + 0.25*cimag(z));
+        ty = tyy & (template_h-1);
+        tn = ((txx >> template_w_bits)+(tyy >> template_h_bits))%2;
+        if ((tx!=txx || ty!=tyy) && n > 1 && template_hit(f->mask, tn*template_h + ty, tx)) break;
+        
+        if (detect_cycles && n > 1)
+        {
+            history[n] = (tn*template_h + ty)*template_w + tx;
+            if (n > 2 && (memcmp(&z, &last, sizeof(z)) == 0 || isnan(creal(z)) || isnan(cimag(z)))) return cycle_result(history, 1, 0, n, 1, texel);
+            if (n > 2 && memcmp(&z, &saved, sizeof(z)) == 0) return cycle_result(history, 1, 0, n, n - s, texel);
+            if (n == 2*s || n == 2) {saved = z; s = n;}
+            last = z;
+        }
+        
+        // Iterate z
+        zz = z*z;
+        den = f->b*zz + f->d;
+        zn = (f->a*zz + f->c)/den;
+        if (detect_cycles && n > 1 && n == s && orbit_contracts(f, z, zn, den, &r) && disc_misses_template(f, z, r))
+        {
+            *texel = history[n];
+            return max_iterations + 1;
+        }
+        z = zn;
+    }
+    
+    *texel = (tn*template_h + ty)*template_w + tx;
+    return n;
+}
+
+void iterate_row_scalar(const fractal_job *f, int y, int x0, int step, int count, int *n, Uint32 *texel)
+{
+    int k;
+    for (k=0 ; k<count ; ++k) n[k] = iterate_pixel(f, x0 + k*step, y, &texel[k]);
+}
+
+//
+// Deep zooms. Once the pixel spacing nears the precision of double, the
+// starting points of neighbouring pixels round to the same values and the
+// image pixelates. Such frames are iterated by perturbation instead: one
+// reference orbit Z_n from near the centre is computed in double-double,
+// and each pixel carries only its difference dz = z - Z from it, which is
+// small but keeps full relative precision in double. With u = z^2 - Z^2 =
+// (2Z + dz) dz, the step z -> (az^2 + c)/(bz^2 + d) becomes
+//
+//     dz -> (ad - bc) u / ((bZ^2 + d + bu)(bZ^2 + d))
+//
+// The cycle and trap tests are made on z = Z + dz rounded to double, as
+// iterate_pixel makes them, and template coordinates are rounded only
+// where that cannot move them (see deep_coordinate). Where z passes much
+// closer to 0 than Z, dz loses its precision relative to z (a glitch),
+// and the pixel is iterated in double-double from there on, as it is past
+// the end of a reference orbit that overflows. Centres in double-double
+// allow zooms to DEEP_ZOOM_LIMIT.
+//
+
+// The error terms below are only exact without FMA contraction
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+static inline dd_real dd_quick_two_sum(double a, double b)
+{
+    double s = a + b;
+    return (dd_real){s, b - (s - a)};
+}
+
+static inline dd_real dd_two_sum(double a, double b)
+{
+    double s = a + b, v = s - a;
+    return (dd_real){s, (a - (s - v)) + (b - v)};
+}
+
+// Exact product by Dekker's splitting, so FMA hardware is not needed
+static inline dd_real dd_two_prod(double a, double b)
+{
+    double p = a*b, t, ah, al, bh, bl;
+    
+    t = 134217729.0*a; ah = t - (t - a); al = a - ah;
+    t = 134217729.0*b; bh = t - (t - b); bl = b - bh;
+    return (dd_real){p, ((ah*bh - p) + ah*bl + al*bh) + al*bl};
+}
+
+static inline dd_real dd_add(dd_real a, dd_real b)
+{
+    dd_real s = dd_two_sum(a.hi, b.hi), t = dd_two_sum(a.lo, b.lo);
+    
+    s = dd_quick_two_sum(s.hi, s.lo + t.hi);
+    return dd_quick_two_sum(s.hi, s.lo + t.lo);
+}
+
+static inline dd_real dd_sub(dd_real a, dd_real b)
+{
+    return dd_add(a, (dd_real){-b.hi, -b.lo});
+}
+
+static inline dd_real dd_mul(dd_real a, dd_real b)
+{
+    dd_real p = dd_two_prod(a.hi, b.hi);
+    return dd_quick_two_sum(p.hi, p.lo + (a.hi*b.lo + a.lo*b.hi));
+}
+
+// Long division, one double of the quotient at a time
+static inline dd_real dd_div(dd_real a, dd_real b)
+{
+    double q1 = a.hi / b.hi, q2, q3;
+    dd_real r = dd_sub(a, dd_mul(b, (dd_real){q1, 0}));
+    
+    q2 = r.hi / b.hi;
+    r = dd_sub(r, dd_mul(b, (dd_real){q2, 0}));
+    q3 = r.hi / b.hi;
+    return dd_add(dd_quick_two_sum(q1, q2), (dd_real){q3, 0});
+}
+
+static inline dd_complex cdd(complex double hi, complex double lo)
+{
+    return (dd_complex){{creal(hi), creal(lo)}, {cimag(hi), cimag(lo)}};
+}
+
+static inline complex double cdd_round(dd_complex z)
+{
+    return CMPLX(z.re.hi, z.im.hi);
+}
+
+static inline dd_complex cdd_add(dd_complex a, dd_complex b)
+{
+    return (dd_complex){dd_add(a.re, b.re), dd_add(a.im, b.im)};
+}
+
+static inline dd_complex cdd_mul(dd_complex a, dd_complex b)
+{
+    return (dd_complex){dd_sub(dd_mul(a.re, b.re), dd_mul(a.im, b.im)), dd_add(dd_mul(a.re, b.im), dd_mul(a.im, b.re))};
+}
+
+static inline dd_complex cdd_div(dd_complex a, dd_complex b)
+{
+    dd_real m = dd_add(dd_mul(b.re, b.re), dd_mul(b.im, b.im));
+    return (dd_complex){dd_div(dd_add(dd_mul(a.re, b.re), dd_mul(a.im, b.im)), m),
+            dd_div(dd_sub(dd_mul(a.im, b.re), dd_mul(a.re, b.im)), m)};
+}
+
+// One step z -> (az^2 + c)/(bz^2 + d) in double-double, also giving the
+// denominator
+static dd_complex cdd_step(const fractal_job *f, dd_complex z, dd_complex *den)
+{
+    dd_complex zz = cdd_mul(z, z);
+    
+    *den = cdd_add(cdd_mul(cdd(f->b, 0), zz), cdd(f->d, 0));
+    return cdd_div(cdd_add(cdd_mul(cdd(f->a, 0), zz), cdd(f->c, 0)), *den);
+}
+
+// Truncate toward zero, as the (Uint32) conversions of template
+// coordinates do
+static inline Uint32 dd_trunc(dd_real a)
+{
+    double t = trunc(a.hi);
+    
+    if (t == a.hi && (a.hi > 0 ? a.lo < 0 : a.lo > 0)) t += a.hi > 0 ? -1 : 1;
+    return (Sint64)t;
+}
+
+#pragma GCC pop_options
+
+// The template coordinate size*(0.5 + 0.25 (Z + dz)) of a deep zoom orbit,
+// given x, the same computed from z = Z + dz rounded to double. x gives the
+// coordinate unless it is so close to a whole number that rounding might
+// have carried it across, and then it is found in double-double. Without
+// this, texel edges would be rounded into steps at deep zooms.
+static inline Uint32 deep_coordinate(int size, double x, dd_real z, double dz)
+{
+    dd_real t;
+    
+    if (fabs(x - rint(x)) > 0x1p-30*(1 + fabs(x))) return (Sint64)x;
+    t = dd_add(z, (dd_real){dz, 0});
+    return dd_trunc(dd_add((dd_real){0.25*size*t.hi, 0.25*size*t.lo}, (dd_real){0.5*size, 0}));
+}
+
+// Pan the double-double centre + centre_lo by step
+void pan_centre(complex double *centre, complex double *centre_lo, complex double step)
+{
+    dd_complex z = cdd_add(cdd(*centre, *centre_lo), cdd(step, 0));
+    
+    *centre = CMPLX(z.re.hi, z.im.hi);
+    *centre_lo = CMPLX(z.re.lo, z.im.lo);
+}
+
+// Whether a frame of w x h pixels of size px about centre needs the
+// perturbation kernel. The first step squares z, and neighbouring pixels
+// are told apart by how much z^2 differs between them, about 2|z|px,
+// against the sum z^2 + d (of size 1 + |z|^2) that it is added into.
+int deep_zoom(double px, int w, int h, complex double centre)
+{
+    double r = cabs(centre) + px*(w + h)/2; // largest |z| in the frame, roughly
+    return px*(2*r + px) < DEEP_ZOOM_PX*(1 + r*r);
+}
+
+// Compute the reference orbit in o from centre + offset, returning its length
+static int trace_reference_orbit(reference_orbit *o, const fractal_job *f, complex double offset)
+{
+    dd_complex z = cdd_add(cdd(f->centre, f->centre_lo), cdd(offset, 0)), den;
+    int n;
+    
+    o->offset = offset;
+    for (n=0 ; n<=max_iterations ; ++n)
+    {
+        o->z[n] = z;
+        o->zd[n] = cdd_round(z);
+        if (!isfinite(creal(o->zd[n])) || !isfinite(cimag(o->zd[n]))) break;
+        z = cdd_step(f, z, &den);
+        o->den[n] = cdd_round(den);
+    }
+    return o->length = n;
+}
+
+// Make o the reference orbit for f, if it is not already. The orbit from
+// the centre itself is used unless it overflows (as it does straight away
+// from 0 when d = 0), in which case the longest of the orbits from a few
+// points a quarter of the frame width away is used instead.
+void build_reference_orbit(reference_orbit *o, const fractal_job *f)
+{
+    complex double q = f->px * f->w / 4, offsets[5] = {0, q, q*I, -q, -q*I};
+    int k, best = 0, length = -1;
+    
+    if (o->z && o->w == f->w && o->px == f->px && o->iterations == max_iterations
+            && memcmp(&o->centre, &f->centre, sizeof(complex double)) == 0
+            && memcmp(&o->centre_lo, &f->centre_lo, sizeof(complex double)) == 0
+            && o->a == f->a && o->b == f->b && o->c == f->c && o->d == f->d) return;
+    
+    if (o->z == NULL)
+    {
+        o->z = malloc((MAX_ITERATIONS + 1)*sizeof(dd_complex));
+        o->zd = malloc((MAX_ITERATIONS + 1)*sizeof(complex double));
+        o->den = malloc((MAX_ITERATIONS + 1)*sizeof(complex double));
+    }
+    o->w = f->w; o->px = f->px; o->iterations = max_iterations;
+    o->centre = f->centre; o->centre_lo = f->centre_lo;
+    o->a = f->a; o->b = f->b; o->c = f->c; o->d = f->d;
+    
+    for (k=0 ; k<5 && length <= max_iterations ; ++k)
+        if (trace_reference_orbit(o, f, offsets[k]) > length)
+        {
+            best = k;
+            length = o->length;
+        }
+    if (o->offset != offsets[best]) trace_reference_orbit(o, f, offsets[best]);
+}
+
+void free_reference_orbit(reference_orbit *o)
+{
+    free(o->z);
+    free(o->zd);
+    free(o->den);
+    o->z = NULL;
+}
+
+// Set f->deep to orbit, made the reference orbit for f, if f is zoomed in
+// beyond the precision of double, and otherwise to NULL
+void prepare_deep_zoom(fractal_job *f, reference_orbit *orbit)
+{
+    f->deep = NULL;
+    if (!deep_zoom(f->px, f->w, f->h, f->centre)) return;
+    build_reference_orbit(orbit, f);
+    f->deep = orbit;
+}
+
+// Iterate a single pixel of a deep zoom frame by perturbation, otherwise
+// as iterate_pixel does (but with exact template coordinates)
+int iterate_pixel_deep(const fractal_job *f, int x, int y, Uint32 *texel)
+{
+    const reference_orbit *o = f->deep;
+    int n, s = 0, w = f->w, h = f->h, exact = 0;
+    complex double z, dz, u, zn, den, k = f->a*f->d - f->b*f->c, last = 0, saved = 0;
+    dd_complex v = cdd(0, 0), v_den;
+    double r;
+    Uint32 tx = 0, ty = 0, tn = 0, txx, tyy;
+    Uint32 history[max_iterations];
+    
+    dz = f->px * ((x-w/2) + I*(y-h/2)) - o->offset;
+    z = o->zd[0] + dz;
+    
+    for (n=0 ; n<max_iterations ; ++n)
+    {
+        // Find template coordinates
+        txx = deep_coordinate(template_w, template_w*(0.5 + 0.25*creal(z)), exact ? v.re : o->z[n].re, exact ? 0 : creal(dz));
+        tx = txx & (template_w-1);
+        tyy = deep_coordinate(template_h, template_h*(0.5 + 0.25*cimag(z)), exact ? v.im : o->z[n].im, exact ? 0 : cimag(dz));
+        ty = tyy & (template_h-1);
+        tn = ((txx >> template_w_bits)+(tyy >> template_h_bits))%2;
+        if ((tx!=txx || ty!=tyy) && n > 1 && template_hit(f->mask, tn*template_h + ty, tx)) break;
+        
+        if (detect_cycles && n > 1)
+        {
+            history[n] = (tn*template_h + ty)*template_w + tx;
+            if (n > 2 && (memcmp(&z, &last, sizeof(z)) == 0 || isnan(creal(z)) || isnan(cimag(z)))) return cycle_result(history, 1, 0, n, 1, texel);
+            if (n > 2 && memcmp(&z, &saved, sizeof(z)) == 0) return cycle_result(history, 1, 0, n, n - s, texel);
+            if (n == 2*s || n == 2) {saved = z; s = n;}
+            last = z;
+        }
+        
+        // Iterate dz, or z itself once dz has lost its precision
+        if (!exact && (n + 1 >= o->length
+                || creal(z)*creal(z) + cimag(z)*cimag(z) < DEEP_ZOOM_GLITCH*(creal(o->zd[n])*creal(o->zd[n]) + cimag(o->zd[n])*cimag(o->zd[n]))))
+        {
+            v = cdd_add(o->z[n], cdd(dz, 0));
+            exact = 1;
+        }
+        if (exact)
+        {
+            v = cdd_step(f, v, &v_den);
+            zn = cdd_round(v);
+            den = cdd_round(v_den);
+        }
+        else
+        {
+            u = (2*o->zd[n] + dz)*dz;
+            den = o->den[n] + f->b*u;
+            dz = k*u/(den*o->den[n]);
+            zn = o->zd[n+1] + dz;
+        }
+        if (detect_cycles && n > 1 && n == s && orbit_contracts(f, z, zn, den, &r) && disc_misses_template(f, z, r))
+        {
+            *texel = history[n];
+            return max_iterations + 1;
+        }
+        z = zn;
+    }
+    
+    *texel = (tn*template_h + ty)*template_w + tx;
+    return n;
+}
+
+void iterate_row_deep(const fractal_job *f, int y, int x0, int step, int count, int *n, Uint32 *texel)
+{
+    int k;
+    for (k=0 ; k<count ; ++k) n[k] = iterate_pixel_deep(f, x0 + k*step, y, &texel[k]);
+}
+
+// The row kernel for a frame: the selected kernel, or the perturbation
+// kernel for deep zooms
+static inline row_kernel frame_kernel(const fractal_job *f)
+{
+    return f->deep ? iterate_row_deep : iterate_row;
+}
+
+#ifdef HAVE_X86_KERNELS
+//
+// Vectorised kernels. Pixels are iterated 4 (AVX2) or 8 (AVX-512) at a
+// time with real and imaginary parts in separate registers. A lane stops
+// being updated once its pixel hits the template and the group finishes
+// when every lane has stopped.
+//
+// The arithmetic is written to match the scalar code operation for
+// operation: the complex multiplications are expanded as gcc does, the
+// complex division uses Smith's algorithm in the same form as libgcc's
+// __divdc3, and no FMA contraction is allowed. Within the normal double
+// range the results are therefore bit-identical to iterate_pixel().
+// The tolerance is that __divdc3's extra rescaling of operands that are
+// close to overflow or underflow, and its recovery of infinite results,
+// are not reproduced, so orbits passing through such values (e.g. a
+// denominator of exactly zero) can differ. --validate-kernels counts the
+// pixels where that happens for each function mode.
+//
+
+// AVX-512 implies FMA, which gcc would otherwise fuse into the kernels
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+// Convert doubles to Uint32 the way a scalar (Uint32) cast does on x86-64,
+// i.e. the low 32 bits of a 64-bit truncation. The fast path covers the
+// usual case of every lane being within int32 range.
+__attribute__((target("avx2")))
+static inline __m128i cvt_u32_avx2(__m256d v)
+{
+    const __m256d limit = _mm256_set1_pd(2147483648.0);
+    const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+    double d[4];
+    Uint32 u[4];
+    int i;
+    
+    if (!_mm256_movemask_pd(_mm256_cmp_pd(_mm256_and_pd(v, abs_mask), limit, _CMP_NLT_UQ)))
+        return _mm256_cvttpd_epi32(v);
+    
+    _mm256_storeu_pd(d, v);
+    for (i=0 ; i<4 ; ++i) u[i] = d[i];
+    return _mm_loadu_si128((__m128i *)u);
+}
+
+// The lanes of candidates (a bit per lane) whose discs miss the template
+__attribute__((target("avx2")))
+static int trap_lanes(const fractal_job *f, __m256d zr, __m256d zi, __m256d r, int candidates)
+{
+    double re[4], im[4], radius[4];
+    int lane, trapped = 0;
+    
+    _mm256_storeu_pd(re, zr);
+    _mm256_storeu_pd(im, zi);
+    _mm256_storeu_pd(radius, r);
+    for (lane=0 ; lane<4 ; ++lane)
+        if (((candidates >> lane) & 1) && disc_misses_template_avx2(f, CMPLX(re[lane], im[lane]), radius[lane])) trapped |= 1 << lane;
+    return trapped;
+}
+
+__attribute__((target("avx2")))
+void iterate_row_avx2(const fractal_job *f, int y, int x0, int step, int count, int *n, Uint32 *texel)
+{
+    int k, x, i, w = f->w, h = f->h;
+    const long long *mask = (const long long *)f->mask;
+    const __m256d quarter = _mm256_set1_pd(0.25), half = _mm256_set1_pd(0.5);
+    const __m256d tw = _mm256_set1_pd(template_w), th = _mm256_set1_pd(template_h);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d ar = _mm256_set1_pd(creal(f->a)), ai = _mm256_set1_pd(cimag(f->a));
+    const __m256d br = _mm256_set1_pd(creal(f->b)), bi = _mm256_set1_pd(cimag(f->b));
+    const __m256d cr = _mm256_set1_pd(creal(f->c)), ci = _mm256_set1_pd(cimag(f->c));
+    const __m256d dr = _mm256_set1_pd(creal(f->d)), di = _mm256_set1_pd(cimag(f->d));
+    const __m128i wmask = _mm_set1_epi32(template_w-1), hmask = _mm_set1_epi32(template_h-1);
+    const __m128i wbits = _mm_cvtsi32_si128(template_w_bits), hbits = _mm_cvtsi32_si128(template_h_bits);
+    const __m128i tile_bits = _mm_cvtsi32_si128(template_w_bits-3);
+    const __m128i one = _mm_set1_epi32(1), seven = _mm_set1_epi32(7), zero = _mm_setzero_si128();
+    const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    const __m256d b_abs = _mm256_set1_pd(cabs(f->b)), k_abs = _mm256_set1_pd(cabs(f->a*f->d - f->b*f->c));
+    Uint32 history[4*max_iterations];
+    int lane, s, cycled, cycle_n[4];
+    Uint32 cycle_texel[4];
+    
+    for (k=0 ; k+4<=count ; k+=4)
+    {
+        x = x0 + k*step;
+        __m256d zr = _mm256_add_pd(_mm256_set1_pd(creal(f->centre)), _mm256_mul_pd(_mm256_set1_pd(f->px),
+                _mm256_set_pd(x+3*step-w/2, x+2*step-w/2, x+step-w/2, x-w/2)));
+        __m256d zi = _mm256_set1_pd(cimag(f->centre) + f->px * (y-h/2));
+        __m128i active = _mm_set1_epi32(-1);
+        __m128i nres = _mm_set1_epi32(max_iterations), tres = zero, t = zero;
+        __m256i last_r = _mm256_setzero_si256(), last_i = last_r, saved_r = last_r, saved_i = last_r;
+        s = 0;
+        cycled = 0;
+        
+        for (i=0 ; i<max_iterations ; ++i)
+        {
+            // Find template coordinates
+            __m128i txx = cvt_u32_avx2(_mm256_mul_pd(tw, _mm256_add_pd(half, _mm256_mul_pd(quarter, zr))));
+            __m128i tyy = cvt_u32_avx2(_mm256_mul_pd(th, _mm256_add_pd(half, _mm256_mul_pd(quarter, zi))));
+            __m128i tn = _mm_and_si128(_mm_xor_si128(_mm_srl_epi32(txx, wbits), _mm_srl_epi32(tyy, hbits)), one);
+            __m128i tx = _mm_and_si128(txx, wmask);
+            __m128i r = _mm_or_si128(_mm_sll_epi32(tn, hbits), _mm_and_si128(tyy, hmask));
+            t = _mm_or_si128(_mm_sll_epi32(r, wbits), tx);
+            
+            if (i > 1)
+            {
+                __m128i outside = _mm_xor_si128(_mm_cmpeq_epi32(_mm_or_si128(_mm_andnot_si128(wmask, txx), _mm_andnot_si128(hmask, tyy)), zero), _mm_set1_epi32(-1));
+                __m128i word = _mm_add_epi32(_mm_sll_epi32(_mm_srli_epi32(r, 3), tile_bits), _mm_srli_epi32(tx, 3));
+                __m128i bit = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(r, seven), 3), _mm_and_si128(tx, seven));
+                __m256i bits = _mm256_srlv_epi64(_mm256_i32gather_epi64(mask, word, 8), _mm256_cvtepu32_epi64(bit));
+                __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bits, low_halves)), one), one);
+                __m128i stop = _mm_and_si128(_mm_and_si128(outside, hit), active);
+                
+                if (_mm_movemask_epi8(stop))
+                {
+                    nres = _mm_blendv_epi8(nres, _mm_set1_epi32(i), stop);
+                    tres = _mm_blendv_epi8(tres, t, stop);
+                    active = _mm_andnot_si128(stop, active);
+                    if (!_mm_movemask_epi8(active)) break;
+                }
+            }
+            
+            // Cycle detection as in iterate_pixel
+            if (detect_cycles && i > 1)
+            {
+                __m256i bzr = _mm256_castpd_si256(zr), bzi = _mm256_castpd_si256(zi);
+                _mm_storeu_si128((__m128i *)(history + 4*i), t);
+                if (i > 2)
+                {
+                    int fixed = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(
+                            _mm256_cmpeq_epi64(bzr, last_r), _mm256_cmpeq_epi64(bzi, last_i))))
+                            | _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(zr, zr, _CMP_UNORD_Q), _mm256_cmp_pd(zi, zi, _CMP_UNORD_Q)));
+                    int repeat = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(
+                            _mm256_cmpeq_epi64(bzr, saved_r), _mm256_cmpeq_epi64(bzi, saved_i))));
+                    int cycle = (fixed | repeat) & _mm_movemask_ps(_mm_castsi128_ps(active));
+                    
+                    if (cycle)
+                    {
+                        for (lane=0 ; lane<4 ; ++lane) if ((cycle >> lane) & 1)
+                            cycle_n[lane] = cycle_result(history, 4, lane, i, (fixed >> lane) & 1 ? 1 : i - s, &cycle_texel[lane]);
+                        cycled |= cycle;
+                        __m128i stop = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(cycle), lane_bits), lane_bits);
+                        active = _mm_andnot_si128(stop, active);
+                        if (!_mm_movemask_epi8(active)) break;
+                    }
+                }
+                if (i == 2*s || i == 2) {saved_r = bzr; saved_i = bzi; s = i;}
+                last_r = bzr;
+                last_i = bzi;
+            }
+            
+            // Iterate z: zz = z*z
+            __m256d zzr = _mm256_sub_pd(_mm256_mul_pd(zr, zr), _mm256_mul_pd(zi, zi));
+            __m256d zzi = _mm256_add_pd(_mm256_mul_pd(zr, zi), _mm256_mul_pd(zi, zr));
+            
+            // Numerator a*zz + c and denominator b*zz + d
+            __m256d nr = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(ar, zzr), _mm256_mul_pd(ai, zzi)), cr);
+            __m256d ni = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ar, zzi), _mm256_mul_pd(ai, zzr)), ci);
+            __m256d mr = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(br, zzr), _mm256_mul_pd(bi, zzi)), dr);
+            __m256d mi = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(br, zzi), _mm256_mul_pd(bi, zzr)), di);
+            
+            // Smith's division, both branches of __divdc3 at once
+            __m256d flip = _mm256_cmp_pd(_mm256_andnot_pd(sign, mr), _mm256_andnot_pd(sign, mi), _CMP_LT_OQ);
+            __m256d num = _mm256_blendv_pd(mi, mr, flip), den = _mm256_blendv_pd(mr, mi, flip);
+            __m256d p = _mm256_blendv_pd(ni, nr, flip), q = _mm256_blendv_pd(nr, ni, flip);
+            __m256d ratio = _mm256_div_pd(num, den);
+            __m256d denom = _mm256_add_pd(_mm256_mul_pd(num, ratio), den);
+            __m256d zr0 = zr, zi0 = zi;
+            zr = _mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(p, ratio), q), denom);
+            zi = _mm256_div_pd(_mm256_sub_pd(_mm256_mul_pd(q, ratio), p), denom);
+            zi = _mm256_xor_pd(zi, _mm256_andnot_pd(flip, sign));
+            
+            // Trapped orbits as in iterate_pixel, with orbit_contracts vectorised
+            if (detect_cycles && i > 1 && i == s)
+            {
+                __m256d dzr = _mm256_sub_pd(zr, zr0), dzi = _mm256_sub_pd(zi, zi0);
+                __m256d abs_z = _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(zr0, zr0), _mm256_mul_pd(zi0, zi0)));
+                __m256d r = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(4), _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dzr, dzr), _mm256_mul_pd(dzi, dzi)))),
+                        _mm256_mul_pd(_mm256_set1_pd(1e-9), _mm256_add_pd(_mm256_set1_pd(1), abs_z)));
+                __m256d lo = _mm256_sub_pd(_mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(mr, mr), _mm256_mul_pd(mi, mi))),
+                        _mm256_mul_pd(_mm256_mul_pd(b_abs, r), _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(2), abs_z), r)));
+                __m256d lhs = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2), _mm256_add_pd(abs_z, r)), k_abs);
+                __m256d rhs = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(0.7), lo), lo);
+                int candidates = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(lo, _mm256_setzero_pd(), _CMP_GT_OQ), _mm256_cmp_pd(lhs, rhs, _CMP_LT_OQ)))
+                        & _mm_movemask_ps(_mm_castsi128_ps(active));
+                int trapped = candidates ? trap_lanes(f, zr0, zi0, r, candidates) : 0;
+                
+                if (trapped)
+                {
+                    for (lane=0 ; lane<4 ; ++lane) if ((trapped >> lane) & 1)
+                    {
+                        cycle_n[lane] = max_iterations + 1;
+                        cycle_texel[lane] = history[4*i + lane];
+                    }
+                    cycled |= trapped;
+                    __m128i stop = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(trapped), lane_bits), lane_bits);
+                    active = _mm_andnot_si128(stop, active);
+                    if (!_mm_movemask_epi8(active)) break;
+                }
+            }
+        }
+        
+        // Lanes that never hit the template keep the texel of the last iteration
+        tres = _mm_blendv_epi8(tres, t, active);
+        _mm_storeu_si128((__m128i *)(n+k), nres);
+        _mm_storeu_si128((__m128i *)(texel+k), tres);
+        for (lane=0 ; cycled ; ++lane, cycled >>= 1) if (cycled & 1)
+        {
+            n[k+lane] = cycle_n[lane];
+            texel[k+lane] = cycle_texel[lane];
+        }
+    }
+    
+    for ( ; k<count ; ++k) n[k] = iterate_pixel(f, x0 + k*step, y, &texel[k]);
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl,avx2")))
+static __mmask8 trap_lanes512(const fractal_job *f, __m512d zr, __m512d zi, __m512d r, __mmask8 candidates)
+{
+    double re[8], im[8], radius[8];
+    int lane;
+    __mmask8 trapped = 0;
+    
+    _mm512_storeu_pd(re, zr);
+    _mm512_storeu_pd(im, zi);
+    _mm512_storeu_pd(radius, r);
+    for (lane=0 ; lane<8 ; ++lane)
+        if (((candidates >> lane) & 1) && disc_misses_template_avx2(f, CMPLX(re[lane], im[lane]), radius[lane])) trapped |= 1 << lane;
+    return trapped;
+}
+
+__attribute__((target("avx512f,avx512dq,avx512vl,avx2")))
+void iterate_row_avx512(const fractal_job *f, int y, int x0, int step, int count, int *n, Uint32 *texel)
+{
+    int k, x, i, w = f->w, h = f->h;
+    const Uint64 *mask = f->mask;
+    const __m512d quarter = _mm512_set1_pd(0.25), half = _mm512_set1_pd(0.5);
+    const __m512d tw = _mm512_set1_pd(template_w), th = _mm512_set1_pd(template_h);
+    const __m512d ar = _mm512_set1_pd(creal(f->a)), ai = _mm512_set1_pd(cimag(f->a));
+    const __m512d br = _mm512_set1_pd(creal(f->b)), bi = _mm512_set1_pd(cimag(f->b));
+    const __m512d cr = _mm512_set1_pd(creal(f->c)), ci = _mm512_set1_pd(cimag(f->c));
+    const __m512d dr = _mm512_set1_pd(creal(f->d)), di = _mm512_set1_pd(cimag(f->d));
+    const __m256i wmask = _mm256_set1_epi32(template_w-1), hmask = _mm256_set1_epi32(template_h-1);
+    const __m128i wbits = _mm_cvtsi32_si128(template_w_bits), hbits = _mm_cvtsi32_si128(template_h_bits);
+    const __m128i tile_bits = _mm_cvtsi32_si128(template_w_bits-3);
+    const __m256i one = _mm256_set1_epi32(1), seven = _mm256_set1_epi32(7), zero = _mm256_setzero_si256();
+    const __m512d b_abs = _mm512_set1_pd(cabs(f->b)), k_abs = _mm512_set1_pd(cabs(f->a*f->d - f->b*f->c));
+    Uint32 history[8*max_iterations];
+    int lane, s, cycle_n[8];
+    Uint32 cycle_texel[8];
+    __mmask8 cycled;
+    
+    for (k=0 ; k+8<=count ; k+=8)
+    {
+        x = x0 + k*step;
+        __m512d zr = _mm512_add_pd(_mm512_set1_pd(creal(f->centre)), _mm512_mul_pd(_mm512_set1_pd(f->px),
+                _mm512_set_pd(x+7*step-w/2, x+6*step-w/2, x+5*step-w/2, x+4*step-w/2,
+                x+3*step-w/2, x+2*step-w/2, x+step-w/2, x-w/2)));
+        __m512d zi = _mm512_set1_pd(cimag(f->centre) + f->px * (y-h/2));
+        __mmask8 active = 0xff;
+        __m256i nres = _mm256_set1_epi32(max_iterations), tres = zero, t = zero;
+        __m512i last_r = _mm512_setzero_si512(), last_i = last_r, saved_r = last_r, saved_i = last_r;
+        s = 0;
+        cycled = 0;
+        
+        for (i=0 ; i<max_iterations ; ++i)
+        {
+            // Find template coordinates. The 64-bit truncation gives exactly
+            // the scalar (Uint32) cast, including out-of-range values.
+            __m256i txx = _mm512_cvtepi64_epi32(_mm512_cvttpd_epi64(_mm512_mul_pd(tw, _mm512_add_pd(half, _mm512_mul_pd(quarter, zr)))));
+            __m256i tyy = _mm512_cvtepi64_epi32(_mm512_cvttpd_epi64(_mm512_mul_pd(th, _mm512_add_pd(half, _mm512_mul_pd(quarter, zi)))));
+            __m256i tn = _mm256_and_si256(_mm256_xor_si256(_mm256_srl_epi32(txx, wbits), _mm256_srl_epi32(tyy, hbits)), one);
+            __m256i tx = _mm256_and_si256(txx, wmask);
+            __m256i r = _mm256_or_si256(_mm256_sll_epi32(tn, hbits), _mm256_and_si256(tyy, hmask));
+            t = _mm256_or_si256(_mm256_sll_epi32(r, wbits), tx);
+            
+            if (i > 1)
+            {
+                __mmask8 outside = _mm256_cmpneq_epi32_mask(_mm256_or_si256(_mm256_andnot_si256(wmask, txx), _mm256_andnot_si256(hmask, tyy)), zero);
+                __m256i word = _mm256_add_epi32(_mm256_sll_epi32(_mm256_srli_epi32(r, 3), tile_bits), _mm256_srli_epi32(tx, 3));
+                __m256i bit = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(r, seven), 3), _mm256_and_si256(tx, seven));
+                __m512i bits = _mm512_srlv_epi64(_mm512_i32gather_epi64(word, mask, 8), _mm512_cvtepu32_epi64(bit));
+                __mmask8 hit = _mm512_test_epi64_mask(bits, _mm512_set1_epi64(1));
+                __mmask8 stop = outside & hit & active;
+                
+                if (stop)
+                {
+                    nres = _mm256_mask_blend_epi32(stop, nres, _mm256_set1_epi32(i));
+                    tres = _mm256_mask_blend_epi32(stop, tres, t);
+                    active &= ~stop;
+                    if (!active) break;
+                }
+            }
+            
+            // Cycle detection as in iterate_pixel
+            if (detect_cycles && i > 1)
+            {
+                __m512i bzr = _mm512_castpd_si512(zr), bzi = _mm512_castpd_si512(zi);
+                _mm256_storeu_si256((__m256i *)(history + 8*i), t);
+                if (i > 2)
+                {
+                    __mmask8 fixed = (_mm512_cmpeq_epi64_mask(bzr, last_r) & _mm512_cmpeq_epi64_mask(bzi, last_i))
+                            | _mm512_cmp_pd_mask(zr, zr, _CMP_UNORD_Q) | _mm512_cmp_pd_mask(zi, zi, _CMP_UNORD_Q);
+                    __mmask8 repeat = _mm512_cmpeq_epi64_mask(bzr, saved_r) & _mm512_cmpeq_epi64_mask(bzi, saved_i);
+                    __mmask8 cycle = (fixed | repeat) & active;
+                    
+                    if (cycle)
+                    {
+                        for (lane=0 ; lane<8 ; ++lane) if ((cycle >> lane) & 1)
+                            cycle_n[lane] = cycle_result(history, 8, lane, i, (fixed >> lane) & 1 ? 1 : i - s, &cycle_texel[lane]);
+                        cycled |= cycle;
+                        active &= ~cycle;
+                        if (!active) break;
+                    }
+                }
+                if (i == 2*s || i == 2) {saved_r = bzr; saved_i = bzi; s = i;}
+                last_r = bzr;
+                last_i = bzi;
+            }
+            
+            // Iterate z: zz = z*z
+            __m512d zzr = _mm512_sub_pd(_mm512_mul_pd(zr, zr), _mm512_mul_pd(zi, zi));
+            __m512d zzi = _mm512_add_pd(_mm512_mul_pd(zr, zi), _mm512_mul_pd(zi, zr));
+            
+            // Numerator a*zz + c and denominator b*zz + d
+            __m512d nr = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(ar, zzr), _mm512_mul_pd(ai, zzi)), cr);
+            __m512d ni = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ar, zzi), _mm512_mul_pd(ai, zzr)), ci);
+            __m512d mr = _mm512_add_pd(_mm512_sub_pd(_mm512_mul_pd(br, zzr), _mm512_mul_pd(bi, zzi)), dr);
+            __m512d mi = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(br, zzi), _mm512_mul_pd(bi, zzr)), di);
+            
+            // Smith's division, both branches of __divdc3 at once
+            __mmask8 flip = _mm512_cmp_pd_mask(_mm512_abs_pd(mr), _mm512_abs_pd(mi), _CMP_LT_OQ);
+            __m512d num = _mm512_mask_blend_pd(flip, mi, mr), den = _mm512_mask_blend_pd(flip, mr, mi);
+            __m512d p = _mm512_mask_blend_pd(flip, ni, nr), q = _mm512_mask_blend_pd(flip, nr, ni);
+            __m512d ratio = _mm512_div_pd(num, den);
+            __m512d denom = _mm512_add_pd(_mm512_mul_pd(num, ratio), den);
+            __m512d zr0 = zr, zi0 = zi;
+            zr = _mm512_div_pd(_mm512_add_pd(_mm512_mul_pd(p, ratio), q), denom);
+            zi = _mm512_div_pd(_mm512_sub_pd(_mm512_mul_pd(q, ratio), p), denom);
+            zi = _mm512_mask_xor_pd(zi, (__mmask8)~flip, zi, _mm512_set1_pd(-0.0));
+            
+            // Trapped orbits as in iterate_pixel, with orbit_contracts vectorised
+            if (detect_cycles && i > 1 && i == s)
+            {
+                __m512d dzr = _mm512_sub_pd(zr, zr0), dzi = _mm512_sub_pd(zi, zi0);
+                __m512d abs_z = _mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(zr0, zr0), _mm512_mul_pd(zi0, zi0)));
+                __m512d r = _mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(4), _mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(dzr, dzr), _mm512_mul_pd(dzi, dzi)))),
+                        _mm512_mul_pd(_mm512_set1_pd(1e-9), _mm512_add_pd(_mm512_set1_pd(1), abs_z)));
+                __m512d lo = _mm512_sub_pd(_mm512_sqrt_pd(_mm512_add_pd(_mm512_mul_pd(mr, mr), _mm512_mul_pd(mi, mi))),
+                        _mm512_mul_pd(_mm512_mul_pd(b_abs, r), _mm512_add_pd(_mm512_mul_pd(_mm512_set1_pd(2), abs_z), r)));
+                __m512d lhs = _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(2), _mm512_add_pd(abs_z, r)), k_abs);
+                __m512d rhs = _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(0.7), lo), lo);
+                __mmask8 candidates = _mm512_cmp_pd_mask(lo, _mm512_setzero_pd(), _CMP_GT_OQ) & _mm512_cmp_pd_mask(lhs, rhs, _CMP_LT_OQ) & active;
+                __mmask8 trapped = candidates ? trap_lanes512(f, zr0, zi0, r, candidates) : 0;
+                
+                if (trapped)
+                {
+                    for (lane=0 ; lane<8 ; ++lane) if ((trapped >> lane) & 1)
+                    {
+                        cycle_n[lane] = max_iterations + 1;
+                        cycle_texel[lane] = history[8*i + lane];
+                    }
+                    cycled |= trapped;
+                    active &= ~trapped;
+                    if (!active) break;
+                }
+            }
+        }
+        
+        // Lanes that never hit the template keep the texel of the last iteration
+        tres = _mm256_mask_blend_epi32(active, tres, t);
+        _mm256_storeu_si256((__m256i *)(n+k), nres);
+        _mm256_storeu_si256((__m256i *)(texel+k), tres);
+        for (lane=0 ; cycled ; ++lane, cycled >>= 1) if (cycled & 1)
+        {
+            n[k+lane] = cycle_n[lane];
+            texel[k+lane] = cycle_texel[lane];
+        }
+    }
+    
+    for ( ; k<count ; ++k) n[k] = iterate_pixel(f, x0 + k*step, y, &texel[k]);
+}
+#pragma GCC pop_options
+#endif
+
+//
+// Shading. Colour modes 0-3 and 5 depend only on the iteration count, so
+// they are looked up in palettes with an entry per count. Colour mode 4
+// blends the template colour towards white by n/max_iterations, which is
+// looked up per channel in a table indexed by n and the channel value.
+// To smooth the steps between counts, an orbit that only just hit the
+// template (a texel less than DISTANCE_RANGE texels inside the shape, by
+// the distance field) is shaded part of the way towards count n+1, which
+// is what a slightly different orbit would have got by missing it.
+// Inversion flips the RGB bits. Counts above max_iterations (cycles) are
+// shaded as max_iterations except in colour mode 5, which shows the orbit
+// class: escaped orbits in grey by n, unresolved ones in black, fixed
+// points in white and cycles in a colour per period.
+//
+#define PALETTE_SIZE (2*MAX_ITERATIONS + 1)
+Uint32 palette[6][PALETTE_SIZE];                // palette[4] is unused
+unsigned char blend[PALETTE_SIZE*256 + 4];      // padded for 32-bit gathers of the last entry
+int palette_iterations = 0;                     // max_iterations the palettes were built for
+#define SMOOTH_SCALE (256.0f/(DISTANCE_RANGE - 1))  // weight of n+1 per texel, 256 at a depth of 1 texel
+
+void build_palettes()
+{
+    static const Uint32 cycle_colours[6] = {0xff3030, 0x30ff30, 0x3030ff, 0xffff30, 0xff30ff, 0x30ffff};
+    int cmode, n, m, t;
+    unsigned char red, green, blue;
+    
+    for (cmode=0 ; cmode<6 ; ++cmode) for (n=0 ; n<=2*max_iterations ; ++n)
+    {
+        red = green = blue = 0;
+        m = n < max_iterations ? n : max_iterations;
+        
+        if (cmode == 0)
+        {
+            blue = m < 10 ? 25*m : 255;
+            red = m<10 ? 0 : 255*(m-10.0)/(max_iterations-10.0);
+            green = red;
+        }
+        else if (cmode == 1)
+        {
+            red = green = blue = 255;
+            if ((m+0)%3 == 0) {red = 250*m/max_iterations;}
+            if ((m+1)%3 == 0) {green = 250*m/max_iterations;}
+            if ((m+2)%3 == 0) {blue = 250*m/max_iterations;}
+        }
+        else if (cmode == 2)
+        {
+            red = green = blue = 255;
+            if (m%2) red = green = 250*m/max_iterations;
+            else blue = 250*m/max_iterations;
+        }
+        else if (cmode == 3)
+        {
+            red = green = blue = 250*m/max_iterations;
+        }
+        else if (cmode == 5)
+        {
+            if (n < max_iterations) red = green = blue = 64 + 160*n/max_iterations;
+            else if (n == max_iterations + 1) red = green = blue = 255;
+            else if (n > max_iterations + 1)
+            {
+                t = cycle_colours[(n - max_iterations - 2) % 6];
+                red = t >> 16; green = t >> 8; blue = t;
+            }
+        }
+        
+        palette[cmode][n] = (255<<24)+(red<<16)+(green<<8)+blue;
+    }
+    
+    for (n=0 ; n<=2*max_iterations ; ++n) for (t=0 ; t<256 ; ++t)
+    {
+        m = n < max_iterations ? n : max_iterations;
+        blend[n*256 + t] = t + ((double)m/max_iterations)*(255-t);
+    }
+    palette_iterations = max_iterations;
+}
+
+// A shading kernel converts count iteration results into ARGB pixels,
+// taking texels from templates (both templates, laid out as template[0])
+// and, in colour mode 4, the depth of hits from their distance field
+typedef void (*shade_kernel)(const Uint16 *n, const Uint32 *texel, const unsigned char *templates, const float *distance,
+        Uint32 *p, int count, int cmode, int invert_colour);
+
+shade_kernel shade_row = NULL;
+
+void shade_row_scalar(const Uint16 *n, const Uint32 *texel, const unsigned char *templates, const float *distance,
+        Uint32 *p, int count, int cmode, int invert_colour)
+{
+    int k, i, w;
+    const unsigned char *t, *b;
+    unsigned char c[3];
+    float s;
+    Uint32 invert = invert_colour ? 0x00ffffff : 0;
+    
+    if (cmode != 4)
+    {
+        for (k=0 ; k<count ; ++k) p[k] = palette[cmode][n[k]] ^ invert;
+        return;
+    }
+    
+    for (k=0 ; k<count ; ++k)
+    {
+        t = templates + 4*(size_t)texel[k];
+        b = blend + 256*n[k];
+        
+        // Weight (out of 256) of count n+1 for a shallow hit
+        w = 0;
+        if (distance && n[k] < max_iterations)
+        {
+            s = (DISTANCE_RANGE + distance[texel[k]]) * SMOOTH_SCALE;
+            w = s > 256 ? 256 : s > 0 ? (int)s : 0;
+        }
+        for (i=0 ; i<3 ; ++i) c[i] = b[t[i]] + (((b[256 + t[i]] - b[t[i]]) * w) >> 8);
+        p[k] = ((255<<24) + (c[2]<<16) + (c[1]<<8) + c[0]) ^ invert;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+void shade_row_avx2(const Uint16 *n, const Uint32 *texel, const unsigned char *templates, const float *distance,
+        Uint32 *p, int count, int cmode, int invert_colour)
+{
+    int k = 0;
+    const __m256i invert = _mm256_set1_epi32(invert_colour ? 0x00ffffff : 0);
+    const __m256i byte = _mm256_set1_epi32(0xff), alpha = _mm256_set1_epi32(0xff000000);
+    const int *lut = (const int *)palette[cmode == 4 ? 0 : cmode];
+    const int *tpl = (const int *)templates;
+    
+    if (cmode != 4)
+    {
+        for ( ; k+8<=count ; k+=8)
+        {
+            __m256i i = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(n+k)));
+            __m256i c = _mm256_i32gather_epi32(lut, i, 4);
+            _mm256_storeu_si256((__m256i *)(p+k), _mm256_xor_si256(c, invert));
+        }
+    }
+    else if (distance)
+    {
+        const __m256i max_n = _mm256_set1_epi32(max_iterations), next = _mm256_set1_epi32(256);
+        const __m256 depth = _mm256_set1_ps(DISTANCE_RANGE), scale = _mm256_set1_ps(SMOOTH_SCALE);
+        const __m256 full = _mm256_set1_ps(256), none = _mm256_setzero_ps();
+        
+        for ( ; k+8<=count ; k+=8)
+        {
+            __m256i nk = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(n+k)));
+            __m256i row = _mm256_slli_epi32(nk, 8), ti = _mm256_loadu_si256((const __m256i *)(texel+k));
+            __m256i t = _mm256_i32gather_epi32(tpl, ti, 4);
+            
+            // Weight of count n+1 as in shade_row_scalar
+            __m256 s = _mm256_mul_ps(_mm256_add_ps(depth, _mm256_i32gather_ps(distance, ti, 4)), scale);
+            __m256i w = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(s, none), full));
+            w = _mm256_and_si256(w, _mm256_cmpgt_epi32(max_n, nk));
+            
+            __m256i c = alpha;
+            int shift;
+            for (shift=0 ; shift<24 ; shift+=8)
+            {
+                __m256i i = _mm256_add_epi32(row, _mm256_and_si256(_mm256_srli_epi32(t, shift), byte));
+                __m256i b0 = _mm256_and_si256(_mm256_i32gather_epi32((const int *)blend, i, 1), byte);
+                __m256i b1 = _mm256_and_si256(_mm256_i32gather_epi32((const int *)blend, _mm256_add_epi32(i, next), 1), byte);
+                __m256i v = _mm256_add_epi32(b0, _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(b1, b0), w), 8));
+                c = _mm256_or_si256(c, _mm256_slli_epi32(v, shift));
+            }
+            _mm256_storeu_si256((__m256i *)(p+k), _mm256_xor_si256(c, invert));
+        }
+    }
+    
+    shade_row_scalar(n+k, texel+k, templates, distance, p+k, count-k, cmode, invert_colour);
+}
+#endif
+
+// Choose the iteration and shading kernels by name, or the fastest ones
+// this CPU supports if name is NULL. Returns -1 if the kernel is not available.
+int select_kernel(const char *name)
+{
+    const char *chosen = "scalar";
+    
+    iterate_row = iterate_row_scalar;
+    shade_row = shade_row_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_avx512 = has_avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+            && __builtin_cpu_supports("avx512vl");
+    
+    if (name == NULL) name = has_avx512 ? "avx512" : has_avx2 ? "avx2" : "scalar";
+    if (strcmp(name, "avx512") == 0 && has_avx512) {iterate_row = iterate_row_avx512; shade_row = shade_row_avx2; chosen = name;}
+    if (strcmp(name, "avx2") == 0 && has_avx2) {iterate_row = iterate_row_avx2; shade_row = shade_row_avx2; chosen = name;}
+#else
+    if (name == NULL) name = "scalar";
+#endif
+    if (strcmp(name, chosen) != 0)
+    {
+        fprintf(stderr, "Kernel '%s' is not available on this machine\n", name);
+        return -1;
+    }
+    
+    fprintf(stderr, "Using %s iteration kernel\n", chosen);
+    return 0;
+}
+
+// Shade one band of TILE_ROWS rows of the whole frame
+void shade_fractal_tile(void *job, int tile, int thread)
+{
+    fractal_job *f = job;
+    int y, y_end = (tile+1)*TILE_ROWS;
+    
+    if (y_end > f->h) y_end = f->h;
+    for (y=tile*TILE_ROWS ; y<y_end ; ++y)
+        shade_row(f->it.n + y*f->w, f->it.texel + y*f->w, template[0], f->distance, f->p + y*f->w, f->w, f->cmode, f->invert_colour);
+}
+
+// Copy row src into row dst of the frame rotated by 180 degrees about
+// the centre, dst[x] = src[w-x]. Column w lies beyond the frame, so its
+// values are passed in n_w and texel_w.
+static void mirror_row(Uint16 *n_dst, Uint32 *texel_dst, const Uint16 *n_src, const Uint32 *texel_src, int w, Uint16 n_w, Uint32 texel_w)
+{
+    int x = 1;
+    
+    n_dst[0] = n_w;
+    texel_dst[0] = texel_w;
+    
+#ifdef __SSE2__
+    // dst[x..x+7] is src[w-x-7..w-x] reversed
+    for ( ; x+8<=w ; x+=8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(n_src + w-x-7));
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i *)(n_dst + x), v);
+        
+        v = _mm_loadu_si128((const __m128i *)(texel_src + w-x-3));
+        _mm_storeu_si128((__m128i *)(texel_dst + x), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+        v = _mm_loadu_si128((const __m128i *)(texel_src + w-x-7));
+        _mm_storeu_si128((__m128i *)(texel_dst + x+4), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+#endif
+    for ( ; x<w ; ++x)
+    {
+        n_dst[x] = n_src[w-x];
+        texel_dst[x] = texel_src[w-x];
+    }
+}
+
+// Iterate one band of TILE_ROWS rows of the frame for the current pass.
+// Each sample fills the block of pixels below and to the right of it until
+// a later pass replaces them with their own samples. In a symmetric frame
+// only the rows up to the centre row are iterated, and each row above the
+// centre row is then mirrored into the bottom half.
+void render_fractal_tile(void *job, int tile, int thread)
+{
+    fractal_job *f = job;
+    Uint16 *itn = f->it.n;
+    Uint32 *itt = f->it.texel;
+    int w = f->w, h = f->h;
+    int s = 1 << f->level;
+    int k, x, y, xx, yy, x0, step, count, y_start, y_end, i;
+    int n[w];
+    Uint32 texel[w];
+    
+    // Skip tiles finished by an earlier call, and leave the rest for
+    // the next call once the deadline has passed
+    if (f->tile_done[tile]) return;
+    if (f->deadline && (Sint32)(SDL_GetTicks() - f->deadline) >= 0) return;
+    
+    y_start = f->band[tile]*TILE_ROWS;
+    y_end = y_start + TILE_ROWS;
+    if (y_end > f->rows) y_end = f->rows;
+    
+    for (y=y_start ; y<y_end ; y+=s)
+    {
+        // Skip samples already computed by the previous (coarser) pass
+        x0 = 0;
+        step = s;
+        if (f->level < f->first_level && y % (2*s) == 0) {x0 = s; step = 2*s;}
+        count = (w - x0 + step - 1) / step;
+        
+        frame_kernel(f)(f, y, x0, step, count, n, texel);
+        
+        for (k=0 ; k<count ; ++k)
+        {
+            x = x0 + k*step;
+            
+            for (yy=y ; yy<y+s && yy<y_end ; ++yy) for (xx=x ; xx<x+s && xx<w ; ++xx)
+            {
+                i = yy*w+xx;
+                itn[i] = n[k];
+                itt[i] = texel[k];
+            }
+        }
+    }
+    
+    if (f->symmetric)
+    {
+        // Row 0 has no mirror in the frame and the centre row is its own
+        // mirror, already iterated in full. Column w, which mirrors onto
+        // column 0, is only iterated in the last pass; previews repeat
+        // column w-1 instead.
+        for (y=y_start ; y<y_end ; ++y)
+        {
+            if (y == 0 || 2*y >= h) continue;
+            i = y*w + w-1;
+            if (f->level == 0) frame_kernel(f)(f, y, w, 1, 1, n, texel);
+            else {n[0] = itn[i]; texel[0] = itt[i];}
+            mirror_row(itn + (h-y)*w, itt + (h-y)*w, itn + y*w, itt + y*w, w, n[0], texel[0]);
+        }
+    }
+    
+    f->tile_done[tile] = 1;
+    SDL_AtomicAdd(&f->tiles_done, 1);
+}
+
+// Make room for count edge pixels with samples samples in total
+void reserve_edges(iteration_buffer *it, int count, int samples)
+{
+    if (count > it->edge_space)
+    {
+        it->edge = realloc(it->edge, count*sizeof(Uint32));
+        it->edge_space = count;
+    }
+    if (samples > it->sample_space)
+    {
+        it->edge_n = realloc(it->edge_n, samples*sizeof(Uint16));
+        it->edge_texel = realloc(it->edge_texel, samples*sizeof(Uint32));
+        it->sample_space = samples;
+    }
+}
+
+// Copy the edge pixels and their samples from src to dst
+void copy_edges(iteration_buffer *dst, const iteration_buffer *src)
+{
+    int samples = src->edges * src->aa * src->aa;
+    
+    reserve_edges(dst, src->edges, samples);
+    dst->edges = src->edges;
+    dst->aa = src->aa;
+    memcpy(dst->edge, src->edge, src->edges*sizeof(Uint32));
+    memcpy(dst->edge_n, src->edge_n, samples*sizeof(Uint16));
+    memcpy(dst->edge_texel, src->edge_texel, samples*sizeof(Uint32));
+}
+
+static inline int edge_between(const iteration_buffer *it, int i, int j, int tshift)
+{
+    return it->n[i] != it->n[j] || (it->texel[i] >> tshift) != (it->texel[j] >> tshift);
+}
+
+// Scan for edge pixels, one band of TILE_ROWS rows per tile. The first
+// pass counts the edge pixels of each band and the second lists them,
+// starting at the total count of the bands before.
+typedef struct
+{
+    iteration_buffer *it;
+    int w, h, pass;
+    int *count;
+} edge_scan;
+
+void scan_edges_tile(void *job, int tile, int thread)
+{
+    edge_scan *e = job;
+    const iteration_buffer *it = e->it;
+    int w = e->w, h = e->h, x, y, i, y_end = (tile+1)*TILE_ROWS, count = 0;
+    int tshift = template_w_bits + template_h_bits;
+    Uint32 *edge = e->pass ? it->edge + e->count[tile] : NULL;
+    
+    if (y_end > h) y_end = h;
+    for (y=tile*TILE_ROWS ; y<y_end ; ++y) for (x=0 ; x<w ; ++x)
+    {
+        i = y*w + x;
+        if ((x > 0 && edge_between(it, i, i-1, tshift)) || (x < w-1 && edge_between(it, i, i+1, tshift))
+                || (y > 0 && edge_between(it, i, i-w, tshift)) || (y < h-1 && edge_between(it, i, i+w, tshift)))
+        {
+            if (edge) edge[count] = i;
+            count++;
+        }
+    }
+    if (!e->pass) e->count[tile] = count;
+}
+
+// Find the pixels whose iteration count or template differs from a
+// horizontal or vertical neighbour. The colour changes there, so those
+// are the pixels that alias; everywhere else extra samples would give
+// the same colour. The scan is run by run_tiles: parallel_tiles, or
+// serial_tiles on threads that render frames on their own.
+void find_edges(iteration_buffer *it, int w, int h, void (*run_tiles)(tile_function, void *, int))
+{
+    int tiles = (h + TILE_ROWS - 1)/TILE_ROWS, t, total = 0, count;
+    edge_scan e = {it, w, h, 0, malloc(tiles*sizeof(int))};
+    
+    run_tiles(scan_edges_tile, &e, tiles);
+    for (t=0 ; t<tiles ; ++t)
+    {
+        count = e.count[t];
+        e.count[t] = total;
+        total += count;
+    }
+    
+    reserve_edges(it, total, total * it->aa * it->aa);
+    e.pass = 1;
+    run_tiles(scan_edges_tile, &e, tiles);
+    it->edges = total;
+    free(e.count);
+}
+
+// Iterate the aa x aa samples of one chunk of edge pixels. The samples
+// of pixel (x, y) are spaced 1/aa pixels apart, from (x-1/2, y-1/2).
+// Runs of adjacent edge pixels in a row are iterated together, so the
+// vector kernels get whole rows of samples.
+#define EDGE_CHUNK 256
+void supersample_edge_tile(void *job, int tile, int thread)
+{
+    fractal_job *f = job, ss = *f;
+    int aa = f->it.aa, e, run, e_end, j, k, x, y;
+    int n[EDGE_CHUNK*4];
+    Uint32 texel[EDGE_CHUNK*4];
+    
+    if (f->tile_done[tile]) return;
+    if (f->deadline && (Sint32)(SDL_GetTicks() - f->deadline) >= 0) return;
+    
+    // Iterate on a grid 2*aa times finer than the frame, taking every
+    // other point so that sample k of a pixel lies at x + (k + 0.5)/aa - 0.5
+    // and the samples are centred on the pixel for even aa as well
+    ss.w = f->w * 2*aa;
+    ss.h = f->h * 2*aa;
+    ss.px = f->px / (2*aa);
+    
+    e_end = (tile+1)*EDGE_CHUNK;
+    if (e_end > f->it.edges) e_end = f->it.edges;
+    for (e=tile*EDGE_CHUNK ; e<e_end ; e+=run)
+    {
+        x = f->it.edge[e] % f->w;
+        y = f->it.edge[e] / f->w;
+        for (run=1 ; e+run<e_end && f->it.edge[e+run] == f->it.edge[e]+run && x+run < f->w ; ++run);
+        
+        for (j=0 ; j<aa ; ++j)
+        {
+            frame_kernel(&ss)(&ss, 2*(y*aa + j) + 1 - aa, 2*x*aa + 1 - aa, 2, run*aa, n, texel);
+            for (k=0 ; k<run*aa ; ++k)
+            {
+                f->it.edge_n[((e + k/aa)*aa + j)*aa + k%aa] = n[k];
+                f->it.edge_texel[((e + k/aa)*aa + j)*aa + k%aa] = texel[k];
+            }
+        }
+    }
+    
+    f->tile_done[tile] = 1;
+    SDL_AtomicAdd(&f->tiles_done, 1);
+}
+
+// Shade one chunk of edge pixels as the average colour of their samples
+void shade_edge_tile(void *job, int tile, int thread)
+{
+    fractal_job *f = job;
+    int ss = f->it.aa * f->it.aa, e, e0 = tile*EDGE_CHUNK, e_end, k;
+    Uint32 samples[EDGE_CHUNK*16], r, g, b, c;
+    
+    if (!f->shade_all_edges && !f->tile_done[tile]) return;
+    
+    e_end = e0 + EDGE_CHUNK;
+    if (e_end > f->it.edges) e_end = f->it.edges;
+    shade_row(f->it.edge_n + e0*ss, f->it.edge_texel + e0*ss, template[0], f->distance, samples, (e_end - e0)*ss, f->cmode, f->invert_colour);
+    
+    for (e=e0 ; e<e_end ; ++e)
+    {
+        r = g = b = 0;
+        for (k=0 ; k<ss ; ++k)
+        {
+            c = samples[(e-e0)*ss + k];
+            r += (c >> 16) & 255;
+            g += (c >> 8) & 255;
+            b += c & 255;
+        }
+        f->p[f->it.edge[e]] = 0xff000000 | (((r + ss/2)/ss) << 16) | (((g + ss/2)/ss) << 8) | ((b + ss/2)/ss);
+    }
+}
+
+// Set the parameters of the function z -> (a*z^2 + c)/(b*z^2 + d) for
+// each function mode, given the value of c (which is derived from the
+// mouse position in interactive mode)
+void set_function(int function_mode, complex double c,
+        complex double *a, complex double *b, complex double *cc, complex double *d)
+{
+    *a = *b = *cc = *d = 1;
+    
+    if (function_mode == 0)
+    {
+        *a = 1; *b = 1;
+        *cc = c;
+        *d = 0;
+    }
+    else if (function_mode == 1)
+    {
+        *a = 1; *b = 1;
+        *cc = c;
+        *d = -0.625 - 0.4*I;
+    }
+    else if (function_mode == 2)
+    {
+        *a = 1;
+        *b = *cc = c;
+        *d = 0;
+    }
+    else if (function_mode == 3)
+    {
+        *a = 1;
+        *b = 0;
+        *cc = c;
+        *d = 1;
+    }
+}
+
+// Compare every available kernel against the scalar reference on all four
+// function modes, using a test pattern in the templates. Returns the
+// number of kernels with mismatching pixels (0 if everything agrees).
+int validate_kernels()
+{
+    const char *names[] = {"avx2", "avx512"};
+    complex double c = 0.005 * (140 + 60*I);
+    complex double params[4][4] = {
+        {1, 1, c, 0},
+        {1, 1, c, -0.625 - 0.4*I},
+        {1, c, c, 0},
+        {1, 0, c, 1} };
+    int k, m, x, y, tx, ty, tn, diff, failures = 0;
+    int *n_ref = malloc(W*sizeof(int)), *n = malloc(W*sizeof(int));
+    Uint32 *t_ref = malloc(W*sizeof(Uint32)), *t = malloc(W*sizeof(Uint32));
+    
+    // Test pattern: a disc in template 0 and a coarse checkerboard in template 1
+    for (tn=0 ; tn<2 ; ++tn) for (y=0 ; y<template_h ; ++y) for (x=0 ; x<template_w ; ++x)
+    {
+        tx = x*1024/template_w; ty = y*1024/template_h;
+        TEMPLATE_PIXEL(tn, y, x)[0] = x; TEMPLATE_PIXEL(tn, y, x)[1] = y; TEMPLATE_PIXEL(tn, y, x)[2] = x^y;
+        if (tn == 0) TEMPLATE_PIXEL(tn, y, x)[3] = (tx-512)*(tx-512) + (ty-400)*(ty-400) < 300*300 ? 255 : 0;
+        else TEMPLATE_PIXEL(tn, y, x)[3] = ((tx/64 + ty/64) % 3) ? 255 : 0;
+    }
+    template_generation++;
+    
+    for (k=0 ; k<2 ; ++k)
+    {
+        fprintf(stderr, "Validating %s kernel\n", names[k]);
+        if (select_kernel(names[k]) < 0) continue;
+        
+        for (m=0 ; m<8 ; ++m)
+        {
+            fractal_job job = {NULL, {NULL, NULL}, W, H, 0.005, 0, params[m/2][0], params[m/2][1], params[m/2][2], params[m/2][3], 0, 0, m%2, get_template_mask(m%2), get_template_mip(m%2)};
+            diff = 0;
+            for (y=0 ; y<=H/2 ; ++y)
+            {
+                iterate_row_scalar(&job, y, 0, 1, W, n_ref, t_ref);
+                iterate_row(&job, y, 0, 1, W, n, t);
+                for (x=0 ; x<W ; ++x) if (n[x] != n_ref[x] || t[x] != t_ref[x]) ++diff;
+            }
+            printf("%s: function mode %d, reverse_template %d: %d of %d pixels differ\n", names[k], m/2, m%2, diff, W*(H/2+1));
+            if (diff) ++failures;
+        }
+    }
+    
+    free(n_ref); free(n); free(t_ref); free(t);
+    return failures;
+}
+
+// Copy cached iteration results into it if there are some for this key
+int frame_cache_lookup(const frame_key *key, iteration_buffer *it)
+{
+    int i, size = key->w * key->h;
+    for (i=0 ; i<FRAME_CACHE_SIZE ; ++i)
+    {
+        if (frame_cache[i].it.n && memcmp(&frame_cache[i].key, key, sizeof(frame_key)) == 0)
+        {
+            memcpy(it->n, frame_cache[i].it.n, size * sizeof(Uint16));
+            memcpy(it->texel, frame_cache[i].it.texel, size * sizeof(Uint32));
+            copy_edges(it, &frame_cache[i].it);
+            frame_cache[i].last_used = SDL_GetTicks();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copy completed iteration results to last_frame, which has its own
+// buffers: the frame's buffers are swapped and reused by later frames
+void keep_last_frame(const iteration_buffer *it, int size)
+{
+    static int space = 0; // pixels allocated in last_frame
+    
+    if (size > space)
+    {
+        space = size;
+        last_frame.n = realloc(last_frame.n, size * sizeof(Uint16));
+        last_frame.texel = realloc(last_frame.texel, size * sizeof(Uint32));
+    }
+    memcpy(last_frame.n, it->n, size * sizeof(Uint16));
+    memcpy(last_frame.texel, it->texel, size * sizeof(Uint32));
+    copy_edges(&last_frame, it);
+}
+
+// Store completed iteration results in the cache, replacing the least recently used entry
+void frame_cache_store(const frame_key *key, const iteration_buffer *it)
+{
+    int i, lru = 0, size = key->w * key->h;
+    for (i=1 ; i<FRAME_CACHE_SIZE ; ++i)
+        if (frame_cache[i].last_used < frame_cache[lru].last_used || !frame_cache[i].it.n) lru = i;
+    
+    if (frame_cache[lru].it.n == NULL || frame_cache[lru].key.w * frame_cache[lru].key.h != size)
+    {
+        frame_cache[lru].it.n = realloc(frame_cache[lru].it.n, size * sizeof(Uint16));
+        frame_cache[lru].it.texel = realloc(frame_cache[lru].it.texel, size * sizeof(Uint32));
+    }
+    memcpy(frame_cache[lru].it.n, it->n, size * sizeof(Uint16));
+    memcpy(frame_cache[lru].it.texel, it->texel, size * sizeof(Uint32));
+    copy_edges(&frame_cache[lru].it, it);
+    frame_cache[lru].key = *key;
+    frame_cache[lru].last_used = SDL_GetTicks();
+}
+
+// Whether a frame centred on centre is symmetric under rotation by 180
+// degrees, so that pixel (w-x, h-y) has the same result as pixel (x, y).
+// Every function mode maps z through z^2 only, so the orbits of z and -z
+// coincide from the first step on and end on the same texel. -z is a pixel
+// of the grid exactly when the frame is centred on 0. The map is also
+// symmetric about the real axis when a, b, c and d are all real, but the
+// orbit then ends on the mirrored texel, which only gives the same result
+// for symmetric templates, so that symmetry is not used.
+int frame_symmetric(complex double centre)
+{
+    return centre == 0;
+}
+
+// When only the view changes (zoom or pan), a new frame starts from the
+// iteration results of the previous one: each pixel takes the result of
+// the nearest pixel of the previous frame at the same point of the plane,
+// or of the nearest edge pixel if that point was outside it. The pixel
+// grids of the two views do not line up, so every pixel is still iterated,
+// but there is a whole (approximate) image to show straight away.
+typedef struct
+{
+    iteration_buffer *dst;
+    const iteration_buffer *src;
+    int w, h;
+    int *src_x, *src_y; // column and row of the previous frame for each column and row
+} reprojection;
+
+void reproject_tile(void *job, int tile, int thread)
+{
+    reprojection *r = job;
+    int w = r->w, x, y, y_end, i, j;
+    
+    y_end = (tile+1)*TILE_ROWS;
+    if (y_end > r->h) y_end = r->h;
+    for (y=tile*TILE_ROWS ; y<y_end ; ++y)
+    {
+        i = y*w;
+        j = r->src_y[y]*w;
+        for (x=0 ; x<w ; ++x)
+        {
+            r->dst->n[i+x] = r->src->n[j + r->src_x[x]];
+            r->dst->texel[i+x] = r->src->texel[j + r->src_x[x]];
+        }
+    }
+}
+
+// Fill dst, a frame of px and centre (+ centre_lo), from src, the same
+// size frame of src_px and src_centre (+ src_centre_lo)
+void reproject(iteration_buffer *dst, const iteration_buffer *src, int w, int h, double px, complex double centre, complex double centre_lo,
+        double src_px, complex double src_centre, complex double src_centre_lo)
+{
+    reprojection r = {dst, src, w, h, malloc(w*sizeof(int)), malloc(h*sizeof(int))};
+    complex double shift = ((centre - src_centre) + (centre_lo - src_centre_lo)) / src_px;
+    double scale = px / src_px, v;
+    int x, y;
+    
+    for (x=0 ; x<w ; ++x)
+    {
+        v = w/2 + creal(shift) + scale*(x - w/2);
+        r.src_x[x] = v < 0 ? 0 : v > w-1 ? w-1 : (int)(v + 0.5);
+    }
+    for (y=0 ; y<h ; ++y)
+    {
+        v = h/2 + cimag(shift) + scale*(y - h/2);
+        r.src_y[y] = v < 0 ? 0 : v > h-1 ? h-1 : (int)(v + 0.5);
+    }
+    parallel_tiles(reproject_tile, &r, (h + TILE_ROWS - 1)/TILE_ROWS);
+    free(r.src_x);
+    free(r.src_y);
+}
+
+// List the bands of rows iterated by the tiles of a frame from the centre
+// out, so that a pass interrupted by its deadline has finished the middle
+// of the frame, where the eye is. In a symmetric frame the bands only
+// reach the centre row, so they are taken from the last one back.
+void order_bands(int *band, int tiles, int h)
+{
+    int i, j;
+    
+    for (i=0 ; i<tiles ; ++i)
+    {
+        // Insert band i by distance from the centre row
+        for (j=i ; j>0 && abs(band[j-1]*TILE_ROWS + TILE_ROWS/2 - h/2) > abs(i*TILE_ROWS + TILE_ROWS/2 - h/2) ; --j)
+            band[j] = band[j-1];
+        band[j] = i;
+    }
+    interleave_tiles(band, tiles);
+}
+
+// Colour correction for the centre point of a finished frame, where z = 0
+// and the first step divides by zero when d = 0
+void correct_centre_point(fractal_job *f)
+{
+    int i = (f->h/2)*f->w + f->w/2, j = i + f->w;
+    
+    if (f->d == 0 && f->centre == 0)
+    {
+        f->it.n[i] = f->it.n[j];
+        f->it.texel[i] = f->it.texel[j];
+    }
+}
+
+// Number of samples computed by one pass of a frame
+double pass_samples(int w, int rows, int level, int first_level)
+{
+    int s = 1 << level;
+    double samples = (double)((w+s-1)/s) * ((rows+s-1)/s);
+    if (level < first_level) samples -= (double)((w+2*s-1)/(2*s)) * ((rows+2*s-1)/(2*s));
+    return samples;
+}
+
+// Render the fractal into p. This is done in two stages: the iteration
+// stage fills an iteration buffer with n and the final template texel of
+// every pixel, and the shading stage converts those into colours. A change
+// of colour mode or inversion only repeats the shading stage.
+//
+// Iteration tiles are only started before the deadline (an SDL_GetTicks()
+// time, or 0 for no limit), so the frame may be left unfinished. Calling
+// again with the same parameters resumes the frame where it stopped;
+// different parameters start a new frame. The unfinished frame is still
+// shaded into p. Returns FRAME_COMPLETE when the frame is complete,
+// FRAME_PARTIAL if it is still in progress, or FRAME_UNCHANGED if p
+// already holds the finished frame. The iteration results of recently
+// completed frames are taken from the frame cache instead of recomputed.
+//
+// With a deadline, a new frame starts with the finest preview level
+// whose first pass is expected to fit before the deadline, based on the
+// measured time per sample. That pass always runs to completion so a
+// whole (blocky) image is shown at once, for example while the mouse is
+// moving, and later passes refine it down to single pixels. If only the
+// view has changed since the last frame (see reproject), the new frame
+// instead starts from the previous image and is iterated at full
+// resolution from the centre out, so a zoom shows the old image scaled
+// until the new one replaces it.
+//
+// The centre is centre + centre_lo in double-double (centre_lo may be 0).
+// Frames zoomed in beyond the precision of double are iterated by
+// perturbation (see iterate_pixel_deep).
+int generate_fractal(Uint32 *p, int w, int h, double px, complex double centre, complex double centre_lo, complex double a, complex double b, complex double c, complex double d, int cmode, int invert_colour, int reverse_template, Uint32 deadline)
+{
+    static fractal_job job;
+    static int tiles = 0, in_progress = 0, size = 0;
+    static int tile_space = 0;      // flags allocated in job.tile_done
+    static int band_space = 0;      // entries allocated in job.band
+    static int edge_tiles = 0;      // tiles of the anti-aliasing pass
+    static Uint32 start_time;
+    static double sample_time = -1; // ms per sample, or -1 if not yet measured
+    static double pass_time;        // ms spent so far in the current pass
+    static frame_key job_key;       // key of the frame in progress or last completed
+    static int finished = 0;        // iteration buffer holds the completed frame for job_key
+    static int shaded = 0;          // p holds the shading of the completed frame
+    static int covered = 0;         // iteration buffer holds a whole image for job_key (maybe a preview)
+    static iteration_buffer spare;  // previous image while a frame is reprojected
+    static reference_orbit orbit;   // for deep zooms
+    frame_key key, view_key;
+    int x, status, ntiles, same_view, iterating;
+    double old_px;
+    complex double old_centre, old_centre_lo;
+    Uint16 *swap_n;
+    Uint32 *swap_texel;
+    Uint64 pass_start, stage_start;
+    double budget;
+    
+    if (shade_row == NULL) select_kernel(NULL);
+    if (palette_iterations != max_iterations) build_palettes();
+    
+    memset(&key, 0, sizeof(key)); // clear padding for memcmp
+    key.w = w; key.h = h; key.px = px; key.centre = centre; key.centre_lo = centre_lo;
+    key.a = a; key.b = b; key.c = c; key.d = d;
+    key.reverse_template = reverse_template;
+    key.template_generation = template_generation;
+    key.aa = aa_samples;
+    key.max_iterations = max_iterations;
+    key.detect_cycles = detect_cycles;
+    
+    // Colour changes only need the finished frame to be shaded again
+    if (memcmp(&key, &job_key, sizeof(key)) != 0)
+    {
+        finished = 0;
+        if (in_progress)
+        {
+            in_progress = 0;
+            frame_stats.abandoned++;
+        }
+    }
+    else if (finished && shaded && job.p == p && job.cmode == cmode && job.invert_colour == invert_colour)
+    {
+        return FRAME_UNCHANGED;
+    }
+    job.p = p;
+    job.cmode = cmode;
+    job.invert_colour = invert_colour;
+    job.distance = cmode == 4 ? get_template_distance(reverse_template) : NULL;
+    
+    if (!finished && !in_progress)
+    {
+        // Only the view differs from the last frame
+        view_key = job_key;
+        view_key.px = px;
+        view_key.centre = centre;
+        view_key.centre_lo = centre_lo;
+        same_view = covered && memcmp(&key, &view_key, sizeof(key)) == 0;
+        job_key = key;
+        
+        if (size != w*h)
+        {
+            size = w*h;
+            free(job.it.n);
+            free(job.it.texel);
+            job.it.n = simd_alloc(size * sizeof(Uint16));
+            job.it.texel = simd_alloc(size * sizeof(Uint32));
+            free(spare.n);
+            free(spare.texel);
+            spare.n = NULL;
+        }
+        old_px = job.px;
+        old_centre = job.centre;
+        old_centre_lo = job.centre_lo;
+        covered = 0;
+        
+        job.w = w; job.h = h; job.px = px; job.centre = centre; job.centre_lo = centre_lo;
+        job.symmetric = frame_symmetric(centre);
+        job.rows = job.symmetric ? h/2 + 1 : h;
+        job.a = a; job.b = b; job.c = c; job.d = d;
+        job.reverse_template = reverse_template;
+        job.mask = get_template_mask(reverse_template);
+        job.mip = get_template_mip(reverse_template);
+        prepare_deep_zoom(&job, &orbit);
+        job.it.edges = 0;
+        job.it.aa = aa_samples;
+        
+        if (frame_cache_lookup(&key, &job.it))
+        {
+            finished = 1;
+            covered = 1;
+            frame_stats.cached++;
+        }
+        else
+        {
+            tiles = (job.rows + TILE_ROWS - 1)/TILE_ROWS;
+            if (tiles > tile_space)
+            {
+                tile_space = tiles;
+                job.tile_done = realloc(job.tile_done, tile_space);
+            }
+            if (tiles > band_space)
+            {
+                band_space = tiles;
+                job.band = realloc(job.band, band_space*sizeof(int));
+            }
+            order_bands(job.band, tiles, h);
+            
+            // Start from the previous image if only the view has changed,
+            // and otherwise choose the preview level
+            job.first_level = 0;
+            job.reprojected = deadline && same_view;
+            if (job.reprojected)
+            {
+                if (spare.n == NULL)
+                {
+                    spare.n = simd_alloc(size * sizeof(Uint16));
+                    spare.texel = simd_alloc(size * sizeof(Uint32));
+                }
+                reproject(&spare, &job.it, w, h, px, centre, centre_lo, old_px, old_centre, old_centre_lo);
+                swap_n = job.it.n; job.it.n = spare.n; spare.n = swap_n;
+                swap_texel = job.it.texel; job.it.texel = spare.texel; spare.texel = swap_texel;
+                covered = 1;
+                frame_stats.reprojected++;
+            }
+            else if (deadline)
+            {
+                budget = (Sint32)(deadline - SDL_GetTicks());
+                job.first_level = MAX_PREVIEW_LEVEL;
+                while (sample_time >= 0 && job.first_level > 0
+                        && sample_time * pass_samples(w, job.rows, job.first_level-1, job.first_level-1) < budget)
+                    job.first_level--;
+            }
+            job.level = job.first_level;
+            
+            memset(job.tile_done, 0, tiles);
+            SDL_AtomicSet(&job.tiles_done, 0);
+            start_time = SDL_GetTicks();
+            pass_time = 0;
+            in_progress = 1;
+        }
+    }
+    
+    status = finished ? FRAME_COMPLETE : FRAME_PARTIAL;
+    iterating = in_progress;
+    stage_start = SDL_GetPerformanceCounter();
+    while (in_progress)
+    {
+        // The first pass of a frame is always finished, unless the
+        // reprojected previous image stands in for the rest
+        job.deadline = job.level == job.first_level && !job.reprojected ? 0 : deadline;
+        
+        // Iterate, one band of rows per tile, or one chunk of edge pixels
+        // per tile in the anti-aliasing pass
+        ntiles = job.level < 0 ? edge_tiles : tiles;
+        pass_start = SDL_GetPerformanceCounter();
+        parallel_tiles(job.level < 0 ? supersample_edge_tile : render_fractal_tile, &job, ntiles);
+        pass_time += 1000.0 * (SDL_GetPerformanceCounter() - pass_start) / SDL_GetPerformanceFrequency();
+        
+        if (SDL_AtomicGet(&job.tiles_done) < ntiles)
+        {
+            frame_stats.partial++;
+            break;
+        }
+        covered = 1;
+        
+        // Update the estimate of the time per sample
+        if (job.level >= 0)
+        {
+            x = pass_samples(w, job.rows, job.level, job.first_level);
+            sample_time = sample_time < 0 ? pass_time / x : 0.7*sample_time + 0.3*pass_time / x;
+        }
+        pass_time = 0;
+        
+        if (job.level == 0)
+        {
+            correct_centre_point(&job);
+        }
+        
+        if (job.level == 0 && job.it.aa > 1)
+        {
+            // Find the edge pixels for the anti-aliasing pass
+            find_edges(&job.it, w, h, parallel_tiles);
+            edge_tiles = (job.it.edges + EDGE_CHUNK - 1)/EDGE_CHUNK;
+            if (edge_tiles > tile_space)
+            {
+                tile_space = edge_tiles;
+                job.tile_done = realloc(job.tile_done, tile_space);
+            }
+        }
+        else if (job.level <= 0)
+        {
+            in_progress = 0;
+            finished = 1;
+            frame_cache_store(&key, &job.it);
+            keep_last_frame(&job.it, w*h);
+            frame_stats.complete++;
+            frame_stats.render_time += SDL_GetTicks() - start_time;
+            status = FRAME_COMPLETE;
+            break;
+        }
+        
+        // Start the next, finer pass
+        job.level--;
+        memset(job.tile_done, 0, job.level < 0 ? edge_tiles : tiles);
+        SDL_AtomicSet(&job.tiles_done, 0);
+        if (deadline && (Sint32)(SDL_GetTicks() - deadline) >= 0)
+        {
+            frame_stats.partial++;
+            break;
+        }
+    }
+    
+    if (iterating)
+    {
+        record_stage(METRIC_ITERATE, stage_start);
+        if (metrics.enabled && status == FRAME_COMPLETE) count_frame(&job.it, w, h);
+    }
+    
+    // Shade the whole frame, finished or not, then the edge pixels that
+    // have been supersampled
+    stage_start = SDL_GetPerformanceCounter();
+    parallel_tiles(shade_fractal_tile, &job, (h + TILE_ROWS - 1)/TILE_ROWS);
+    if (job.it.edges)
+    {
+        job.shade_all_edges = finished;
+        parallel_tiles(shade_edge_tile, &job, (job.it.edges + EDGE_CHUNK - 1)/EDGE_CHUNK);
+    }
+    record_stage(METRIC_SHADE, stage_start);
+    shaded = finished;
+    return status;
+}
+
+// Render a whole frame on the calling thread, as generate_fractal does
+// with the thread pool but without deadlines or the frame cache, for
+// callers that render several frames at once on their own threads. f
+// holds the frame parameters (deep set by prepare_deep_zoom), the template
+// mask and iteration buffers for w*h pixels; its tile_done and band arrays
+// are allocated as needed.
+void render_frame(fractal_job *f)
+{
+    int tile, tiles;
+    
+    f->symmetric = frame_symmetric(f->centre);
+    f->rows = f->symmetric ? f->h/2 + 1 : f->h;
+    f->first_level = f->level = 0;
+    f->deadline = 0;
+    f->it.edges = 0;
+    
+    tiles = (f->rows + TILE_ROWS - 1)/TILE_ROWS;
+    f->tile_done = realloc(f->tile_done, tiles);
+    f->band = realloc(f->band, tiles*sizeof(int));
+    memset(f->tile_done, 0, tiles);
+    for (tile=0 ; tile<tiles ; ++tile) f->band[tile] = tile;
+    for (tile=0 ; tile<tiles ; ++tile) render_fractal_tile(f, tile, 0);
+    correct_centre_point(f);
+    
+    // Supersample the edge pixels
+    if (f->it.aa > 1)
+    {
+        find_edges(&f->it, f->w, f->h, serial_tiles);
+        tiles = (f->it.edges + EDGE_CHUNK - 1)/EDGE_CHUNK;
+        f->tile_done = realloc(f->tile_done, tiles + 1);
+        memset(f->tile_done, 0, tiles);
+        f->level = -1;
+        for (tile=0 ; tile<tiles ; ++tile) supersample_edge_tile(f, tile, 0);
+    }
+    
+    tiles = (f->h + TILE_ROWS - 1)/TILE_ROWS;
+    for (tile=0 ; tile<tiles ; ++tile) shade_fractal_tile(f, tile, 0);
+    f->shade_all_edges = 1;
+    tiles = (f->it.edges + EDGE_CHUNK - 1)/EDGE_CHUNK;
+    for (tile=0 ; tile<tiles ; ++tile) shade_edge_tile(f, tile, 0);
+}
+
+// Allocate memory for pixel rows that the kernels load and store with
+// vector instructions: aligned to 64 bytes, which is a cache line and an
+// AVX-512 register, with the size rounded up to match
+void *simd_alloc(size_t size)
+{
+    void *buffer = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+//
+// Thread pool with work stealing. Each job is a range of tile numbers
+// which is initially split evenly between the threads. A thread takes
+// tiles from the front of its own range and, once that is empty, steals
+// the back half of the largest remaining range of another thread. The
+// calling thread works as thread 0 while the pool threads are 1..n-1.
+// Jobs run one at a time: a caller on another thread (the print worker)
+// waits for the job in progress to finish. Background jobs (see
+// background_tiles) also wait for every caller of parallel_tiles, so a
+// long series of small background jobs gives way to the display.
+//
+typedef struct
+{
+    SDL_SpinLock lock;
+    int next, end;   // tiles still owned by this thread
+    int tiles;       // tiles rendered during the last job
+    int steals;      // number of successful steals during the last job
+    Uint64 ticks;    // performance counter ticks spent in tiles during the last job
+    char padding[64]; // keep queues of different threads on separate cache lines
+} tile_queue;
+
+struct
+{
+    int threads;
+    SDL_Thread *thread[MAX_THREADS];
+    SDL_mutex *mutex;
+    SDL_mutex *run;  // held by the thread whose job is running
+    SDL_atomic_t waiting; // callers of parallel_tiles waiting for run
+    SDL_cond *start, *finish;
+    int generation, busy;
+    tile_function fn;
+    void *job;
+    tile_queue queue[MAX_THREADS];
+} pool;
+
+int take_tile(int t)
+{
+    tile_queue *q = &pool.queue[t], *v;
+    int i, victim, remaining, most, tile, end;
+    
+    // Take the next tile from this thread's own range
+    SDL_AtomicLock(&q->lock);
+    tile = q->next < q->end ? q->next++ : -1;
+    SDL_AtomicUnlock(&q->lock);
+    if (tile >= 0) return tile;
+    
+    // Own range is empty, so steal half of the largest remaining range
+    while (1)
+    {
+        victim = -1;
+        most = 0;
+        for (i=0 ; i<pool.threads ; ++i)
+        {
+            remaining = pool.queue[i].end - pool.queue[i].next;
+            if (i != t && remaining > most) {most = remaining; victim = i;}
+        }
+        if (victim < 0) return -1; // nothing left anywhere
+        
+        v = &pool.queue[victim];
+        SDL_AtomicLock(&v->lock);
+        remaining = v->end - v->next;
+        if (remaining > 0)
+        {
+            end = v->end;
+            v->end -= (remaining+1)/2;
+            tile = v->end;
+        }
+        SDL_AtomicUnlock(&v->lock);
+        
+        if (remaining > 0)
+        {
+            SDL_AtomicLock(&q->lock);
+            q->next = tile + 1;
+            q->end = end;
+            q->steals++;
+            SDL_AtomicUnlock(&q->lock);
+            return tile;
+        }
+    }
+}
+
+void run_tiles(int t)
+{
+    int tile;
+    Uint64 start;
+    
+    while ((tile = take_tile(t)) >= 0)
+    {
+        start = SDL_GetPerformanceCounter();
+        pool.fn(pool.job, tile, t);
+        pool.queue[t].ticks += SDL_GetPerformanceCounter() - start;
+        pool.queue[t].tiles++;
+    }
+}
+
+int pool_thread(void *data)
+{
+    int t = (int)(intptr_t)data;
+    int generation = 0;
+    
+    while (1)
+    {
+        // Wait for the next job
+        SDL_LockMutex(pool.mutex);
+        while (pool.generation == generation) SDL_CondWait(pool.start, pool.mutex);
+        generation = pool.generation;
+        SDL_UnlockMutex(pool.mutex);
+        
+        run_tiles(t);
+        
+        // Report that this thread has run out of tiles
+        SDL_LockMutex(pool.mutex);
+        if (--pool.busy == 0) SDL_CondSignal(pool.finish);
+        SDL_UnlockMutex(pool.mutex);
+    }
+    
+    return 0;
+}
+
+// Start the pool threads the first time they are needed
+void start_pool()
+{
+    int t;
+    
+    if (pool.threads) return;
+    pool.threads = SDL_GetCPUCount();
+    if (pool.threads < 1) pool.threads = 1;
+    if (pool.threads > MAX_THREADS) pool.threads = MAX_THREADS;
+    pool.mutex = SDL_CreateMutex();
+    pool.run = SDL_CreateMutex();
+    pool.start = SDL_CreateCond();
+    pool.finish = SDL_CreateCond();
+    for (t=1 ; t<pool.threads ; ++t)
+        pool.thread[t] = SDL_CreateThread(pool_thread, "tile worker", (void *)(intptr_t)t);
+    fprintf(stderr, "Rendering with %d threads\n", pool.threads);
+}
+
+// Rearrange order, a list of ntiles items in priority order that a job
+// looks up by tile number, so that the pool starts them in about that
+// order: the threads start at the front of their ranges together, so the
+// first items are dealt out to the fronts of all the ranges in turn.
+void interleave_tiles(int *order, int ntiles)
+{
+    int next[MAX_THREADS], *dealt = malloc(ntiles*sizeof(int));
+    int i, t;
+    
+    start_pool();
+    for (t=0 ; t<pool.threads ; ++t) next[t] = (int)((long)ntiles * t / pool.threads);
+    for (i=0, t=0 ; i<ntiles ; ++i, t = (t+1) % pool.threads)
+    {
+        // Skip ranges that are already full
+        while (next[t] == (int)((long)ntiles * (t+1) / pool.threads)) t = (t+1) % pool.threads;
+        dealt[next[t]++] = order[i];
+    }
+    memcpy(order, dealt, ntiles*sizeof(int));
+    free(dealt);
+}
+
+// Run a job on the pool. The caller holds pool.run.
+static void run_job(tile_function fn, void *job, int ntiles)
+{
+    int t;
+    
+    // Split tiles evenly between the threads
+    for (t=0 ; t<pool.threads ; ++t)
+    {
+        pool.queue[t].next = (int)((long)ntiles * t / pool.threads);
+        pool.queue[t].end = (int)((long)ntiles * (t+1) / pool.threads);
+        pool.queue[t].tiles = pool.queue[t].steals = 0;
+        pool.queue[t].ticks = 0;
+    }
+    
+    // Wake the pool threads, then work alongside them as thread 0
+    SDL_LockMutex(pool.mutex);
+    pool.fn = fn;
+    pool.job = job;
+    pool.busy = pool.threads - 1;
+    pool.generation++;
+    SDL_CondBroadcast(pool.start);
+    SDL_UnlockMutex(pool.mutex);
+    
+    run_tiles(0);
+    
+    // Wait until every thread has finished
+    SDL_LockMutex(pool.mutex);
+    while (pool.busy > 0) SDL_CondWait(pool.finish, pool.mutex);
+    SDL_UnlockMutex(pool.mutex);
+}
+
+void parallel_tiles(tile_function fn, void *job, int ntiles)
+{
+    start_pool();
+    SDL_AtomicAdd(&pool.waiting, 1);
+    SDL_LockMutex(pool.run);
+    SDL_AtomicAdd(&pool.waiting, -1);
+    run_job(fn, job, ntiles);
+    SDL_UnlockMutex(pool.run);
+}
+
+// Run a job as parallel_tiles does, but only when no caller of
+// parallel_tiles is waiting for the pool
+void background_tiles(tile_function fn, void *job, int ntiles)
+{
+    start_pool();
+    while (1)
+    {
+        while (SDL_AtomicGet(&pool.waiting) > 0) SDL_Delay(1);
+        SDL_LockMutex(pool.run);
+        if (SDL_AtomicGet(&pool.waiting) == 0) break;
+        SDL_UnlockMutex(pool.run);
+    }
+    run_job(fn, job, ntiles);
+    SDL_UnlockMutex(pool.run);
+}
+
+// Run every tile of a job in order on the calling thread, without the pool
+void serial_tiles(tile_function fn, void *job, int ntiles)
+{
+    int tile;
+    
+    for (tile=0 ; tile<ntiles ; ++tile) fn(job, tile, 0);
+}
+
+// Print per-thread tile counts and timing for the most recent job
+void print_thread_stats()
+{
+    int t;
+    double freq = SDL_GetPerformanceFrequency();
+    
+    for (t=0 ; t<pool.threads ; ++t)
+    {
+        printf("Thread %d: %d tiles, %d steals, %.1f ms (%.3f ms/tile)\n", t,
+                pool.queue[t].tiles, pool.queue[t].steals, 1000.0*pool.queue[t].ticks/freq,
+                pool.queue[t].tiles ? 1000.0*pool.queue[t].ticks/freq/pool.queue[t].tiles : 0.0);
+    }
+}
+
+//
+// Metrics (see the declarations at the top). Stage timers are updated by
+// the thread that runs the stage. Pixels are counted by the pool threads
+// into their own histograms after each completed frame, only while the
+// HUD is shown or a metrics file is written, and the totals are summed
+// on the main thread when they are shown or written.
+//
+const char *stage_names[METRIC_STAGES] = {"iterate", "shade", "upload", "present", "capture", "segment", "print"};
+const char *break_names[BREAK_REASONS] = {"hit", "limit", "fixed", "cycle"};
+
+// Record a run of a stage from performance counter time start to now
+void record_stage(int stage, Uint64 start)
+{
+    stage_timer *s = &metrics.stage[stage];
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+
+    s->count++;
+    s->ticks += ticks;
+    if (ticks > s->max_ticks) s->max_ticks = ticks;
+}
+
+#define COUNT_CHUNK 16384 // pixels per tile
+
+typedef struct
+{
+    const Uint16 *n;
+    int pixels;
+} count_job;
+
+void count_pixels_tile(void *job, int tile, int thread)
+{
+    const count_job *c = job;
+    Uint64 *histogram = metrics.thread[thread].histogram, *breaks = metrics.thread[thread].breaks;
+    int i, n, end = (tile+1)*COUNT_CHUNK < c->pixels ? (tile+1)*COUNT_CHUNK : c->pixels;
+
+    for (i=tile*COUNT_CHUNK ; i<end ; ++i)
+    {
+        n = c->n[i];
+        histogram[n < 2*MAX_ITERATIONS ? n : 2*MAX_ITERATIONS]++;
+        breaks[n < max_iterations ? BREAK_HIT : n == max_iterations ? BREAK_LIMIT
+                : n == max_iterations + 1 ? BREAK_FIXED : BREAK_CYCLE]++;
+    }
+}
+
+// Count the iterations of every pixel of a completed frame
+void count_frame(const iteration_buffer *it, int w, int h)
+{
+    count_job c = {it->n, w*h};
+
+    parallel_tiles(count_pixels_tile, &c, (c.pixels + COUNT_CHUNK - 1)/COUNT_CHUNK);
+    metrics.frames++;
+}
+
+// Sum the pixel counts of all threads
+void sum_pixel_counts(Uint64 *histogram, Uint64 *breaks)
+{
+    int t, i;
+
+    memset(histogram, 0, (2*MAX_ITERATIONS + 1)*sizeof(Uint64));
+    memset(breaks, 0, BREAK_REASONS*sizeof(Uint64));
+    for (t=0 ; t<MAX_THREADS ; ++t)
+    {
+        for (i=0 ; i<=2*MAX_ITERATIONS ; ++i) histogram[i] += metrics.thread[t].histogram[i];
+        for (i=0 ; i<BREAK_REASONS ; ++i) breaks[i] += metrics.thread[t].breaks[i];
+    }
+}
+
+// Write the totals since startup to the metrics file as JSON. The file is
+// replaced in one step, so a reader never sees half of it.
+void write_metrics()
+{
+    static Uint64 histogram[2*MAX_ITERATIONS + 1], breaks[BREAK_REASONS];
+    double freq = SDL_GetPerformanceFrequency();
+    char temp[1024];
+    int i, last;
+    FILE *out;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", metrics.file);
+    out = fopen(temp, "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Could not write metrics to %s: %s\n", temp, strerror(errno));
+        return;
+    }
+    sum_pixel_counts(histogram, breaks);
+
+    fprintf(out, "{\"uptime_s\": %.1f, \"max_iterations\": %d, \"frames\": %llu,\n \"stages\": {",
+            SDL_GetTicks() / 1000.0, max_iterations, (unsigned long long)metrics.frames);
+    for (i=0 ; i<METRIC_STAGES ; ++i)
+    {
+        fprintf(out, "%s\n  \"%s\": {\"count\": %llu, \"total_ms\": %.3f, \"max_ms\": %.3f}", i ? "," : "",
+                stage_names[i], (unsigned long long)metrics.stage[i].count,
+                1000.0*metrics.stage[i].ticks/freq, 1000.0*metrics.stage[i].max_ticks/freq);
+    }
+    fprintf(out, "},\n \"breaks\": {");
+    for (i=0 ; i<BREAK_REASONS ; ++i)
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", break_names[i], (unsigned long long)breaks[i]);
+
+    // Pixels with n iterations, for n from 0 to the last count seen
+    fprintf(out, "},\n \"histogram\": [");
+    for (last=2*MAX_ITERATIONS ; last>0 && histogram[last]==0 ; --last);
+    for (i=0 ; i<=last ; ++i) fprintf(out, "%s%llu", i ? (i%16 ? ", " : ",\n  ") : "", (unsigned long long)histogram[i]);
+    fprintf(out, "]}\n");
+
+    if (fclose(out) != 0 || rename(temp, metrics.file) != 0)
+        fprintf(stderr, "Could not write metrics to %s: %s\n", metrics.file, strerror(errno));
+}
+
+//
+// HUD: the stage timings and the orbits of the frames completed over the
+// last second, drawn with cairo into a texture that is copied over the
+// fractal. Timings show runs per second and the average time of a run
+// over the last second, and the longest run since startup.
+//
+#define HUD_WIDTH 360
+#define HUD_HEIGHT 280
+#define HUD_BARS 50 // iteration count histogram bars
+#define HUD_INTERVAL 1000 // ms between updates
+
+struct
+{
+    SDL_Texture *texture; // NULL while the HUD is hidden
+    cairo_surface_t *surface;
+    Uint32 updated;       // SDL ticks of the last update
+
+    // Totals at the last update
+    stage_timer stage[METRIC_STAGES];
+    Uint64 frames, histogram[2*MAX_ITERATIONS + 1], breaks[BREAK_REASONS];
+
+    // Orbits shown: of the frames completed in the last interval that had any
+    double bar[HUD_BARS];
+    double fraction[BREAK_REASONS];
+    double frame_rate;
+} hud;
+
+// Show or hide the HUD, and redraw it if it is shown and due. Returns 1
+// if the screen needs to be presented again.
+int update_hud(SDL_Renderer *renderer, int show)
+{
+    static Uint64 histogram[2*MAX_ITERATIONS + 1], breaks[BREAK_REASONS];
+    double freq = SDL_GetPerformanceFrequency(), seconds, most, pixels;
+    Uint32 now = SDL_GetTicks();
+    Uint64 count, ticks;
+    char line[128];
+    cairo_t *cr;
+    int i, n;
+
+    if (!show)
+    {
+        if (hud.texture == NULL) return 0;
+        SDL_DestroyTexture(hud.texture);
+        hud.texture = NULL;
+        return 1;
+    }
+    if (hud.texture && now - hud.updated < HUD_INTERVAL) return 0;
+    if (hud.texture == NULL)
+    {
+        hud.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, HUD_WIDTH, HUD_HEIGHT);
+        SDL_SetTextureBlendMode(hud.texture, SDL_BLENDMODE_BLEND);
+        if (hud.surface == NULL) hud.surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, HUD_WIDTH, HUD_HEIGHT);
+    }
+    seconds = (now - hud.updated) / 1000.0;
+    hud.updated = now;
+
+    // Orbits of the frames completed since the last update
+    sum_pixel_counts(histogram, breaks);
+    if (metrics.frames != hud.frames)
+    {
+        for (i=0 ; i<HUD_BARS ; ++i) hud.bar[i] = 0;
+        for (n=0 ; n<max_iterations ; ++n) hud.bar[n*HUD_BARS/max_iterations] += histogram[n] - hud.histogram[n];
+        for (i=0, most=1 ; i<HUD_BARS ; ++i) if (hud.bar[i] > most) most = hud.bar[i];
+        for (i=0 ; i<HUD_BARS ; ++i) hud.bar[i] /= most;
+
+        for (i=0, pixels=0 ; i<BREAK_REASONS ; ++i) pixels += breaks[i] - hud.breaks[i];
+        for (i=0 ; i<BREAK_REASONS ; ++i) hud.fraction[i] = (breaks[i] - hud.breaks[i]) / pixels;
+
+        hud.frame_rate = (metrics.frames - hud.frames) / seconds;
+        hud.frames = metrics.frames;
+        memcpy(hud.histogram, histogram, sizeof(histogram));
+        memcpy(hud.breaks, breaks, sizeof(breaks));
+    }
+    else hud.frame_rate = 0;
+
+    cr = cairo_create(hud.surface);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_rgba(cr, 0, 0, 0, 0.6);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    cairo_select_font_face(cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(cr, 12);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+
+    cairo_move_to(cr, 10, 20);
+    cairo_show_text(cr, "stage       runs/s   avg ms   max ms");
+    for (i=0 ; i<METRIC_STAGES ; ++i)
+    {
+        count = metrics.stage[i].count - hud.stage[i].count;
+        ticks = metrics.stage[i].ticks - hud.stage[i].ticks;
+        hud.stage[i] = metrics.stage[i];
+        snprintf(line, sizeof(line), "%-10s %7.1f %8.2f %8.2f", stage_names[i], count / seconds,
+                count ? 1000.0*ticks/freq/count : 0.0, 1000.0*hud.stage[i].max_ticks/freq);
+        cairo_move_to(cr, 10, 38 + 16*i);
+        cairo_show_text(cr, line);
+    }
+
+    snprintf(line, sizeof(line), "%.1f frames/s, %d iterations", hud.frame_rate, max_iterations);
+    cairo_move_to(cr, 10, 164);
+    cairo_show_text(cr, line);
+    snprintf(line, sizeof(line), "hit %.1f%% limit %.1f%% fixed %.1f%% cycle %.1f%%",
+            100*hud.fraction[BREAK_HIT], 100*hud.fraction[BREAK_LIMIT], 100*hud.fraction[BREAK_FIXED], 100*hud.fraction[BREAK_CYCLE]);
+    cairo_move_to(cr, 10, 180);
+    cairo_show_text(cr, line);
+
+    // Histogram of iteration counts below max_iterations
+    for (i=0 ; i<HUD_BARS ; ++i)
+        cairo_rectangle(cr, 10 + i*(HUD_WIDTH-20.0)/HUD_BARS, HUD_HEIGHT - 10, (HUD_WIDTH-20.0)/HUD_BARS - 1, -80*hud.bar[i]);
+    cairo_fill(cr);
+    cairo_destroy(cr);
+
+    cairo_surface_flush(hud.surface);
+    SDL_UpdateTexture(hud.texture, NULL, cairo_image_surface_get_data(hud.surface), cairo_image_surface_get_stride(hud.surface));
+    return 1;
+}
+
+// Copy the HUD, if shown, to the top left corner of the screen
+void draw_hud(SDL_Renderer *renderer)
+{
+    SDL_Rect rect = {16, 16, HUD_WIDTH, HUD_HEIGHT};
+
+    if (hud.texture) SDL_RenderCopy(renderer, hud.texture, NULL, &rect);
+}
+
+//
+// Headless batch rendering. Each frame is rendered with the whole thread
+// pool, then handed to a writer thread that saves it while the next frame
+// renders, so at most two frames are held in memory.
+//
+struct
+{
+    SDL_sem *go, *idle;
+    Uint32 *pixels;
+    char filename[1024];
+    int quit, errors;
+} writer;
+
+// Write an ARGB frame to a binary PPM file or, if the name ends in .png, a PNG file
+int write_image(const char *filename, const Uint32 *pixels, int w, int h)
+{
+    const char *ext = strrchr(filename, '.');
+    int x, y, status = 0;
+    
+    if (ext && strcmp(ext, ".png") == 0)
+    {
+        cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *)pixels,
+                CAIRO_FORMAT_RGB24, w, h, w*sizeof(Uint32));
+        status = cairo_surface_write_to_png(surface, filename) == CAIRO_STATUS_SUCCESS ? 0 : -1;
+        cairo_surface_destroy(surface);
+    }
+    else
+    {
+        FILE *f = fopen(filename, "wb");
+        unsigned char *row = malloc(3*w);
+        if (f == NULL) status = -1;
+        else
+        {
+            fprintf(f, "P6\n%d %d\n255\n", w, h);
+            for (y=0 ; y<h && status == 0 ; ++y)
+            {
+                for (x=0 ; x<w ; ++x)
+                {
+                    row[3*x+0] = pixels[y*w+x] >> 16; // red
+                    row[3*x+1] = pixels[y*w+x] >> 8;  // green
+                    row[3*x+2] = pixels[y*w+x];       // blue
+                }
+                if (fwrite(row, 1, 3*w, f) != (size_t)(3*w)) status = -1;
+            }
+            if (fclose(f)) status = -1;
+        }
+        free(row);
+    }
+    
+    if (status < 0) fprintf(stderr, "Error writing %s\n", filename);
+    return status;
+}
+
+// Check that an output pattern has exactly one integer conversion, such
+// as %d or %05d, and no other conversion except %%
+int valid_output_pattern(const char *pattern)
+{
+    const char *p;
+    int conversions = 0;
+    
+    for (p=strchr(pattern, '%') ; p ; p=strchr(p, '%'))
+    {
+        if (*++p == '%')
+        {
+            p++;
+            continue;
+        }
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if (*p == '.') p += 1 + strspn(p+1, "0123456789");
+        if (*p == 0 || !strchr("diuoxX", *p)) return 0;
+        conversions++;
+        p++;
+    }
+    return conversions == 1;
+}
+
+// Make the file name of frame k from the output pattern. A pattern that
+// is not valid is taken literally, with the frame number added before the
+// extension.
+void frame_filename(char *filename, size_t size, const char *pattern, int k)
+{
+    const char *ext = strrchr(pattern, '.'), *dir = strrchr(pattern, '/');
+    
+    if (valid_output_pattern(pattern)) snprintf(filename, size, pattern, k);
+    else
+    {
+        if (ext == NULL || (dir && ext < dir)) ext = pattern + strlen(pattern);
+        snprintf(filename, size, "%.*s_%05d%s", (int)(ext - pattern), pattern, k, ext);
+    }
+}
+
+int writer_thread(void *data)
+{
+    while (1)
+    {
+        SDL_SemWait(writer.go);
+        if (writer.quit) break;
+        if (write_image(writer.filename, writer.pixels, W, H) < 0) writer.errors++;
+        SDL_SemPost(writer.idle);
+    }
+    return 0;
+}
+
+int run_batch(const batch_settings *batch)
+{
+    complex double a, b, c, d;
+    Uint32 *frame[2];
+    int i, j, k = 0, nx = batch->nx > 0 ? batch->nx : 1, ny = batch->ny > 0 ? batch->ny : 1;
+    double re, im;
+    Uint32 start_time = SDL_GetTicks();
+    SDL_Thread *thread;
+    
+    frame[0] = simd_alloc(W*H*sizeof(Uint32));
+    frame[1] = simd_alloc(W*H*sizeof(Uint32));
+    writer.go = SDL_CreateSemaphore(0);
+    writer.idle = SDL_CreateSemaphore(1);
+    thread = SDL_CreateThread(writer_thread, "frame writer", NULL);
+    if (!valid_output_pattern(batch->output))
+        fprintf(stderr, "Output pattern %s needs one %%d for the frame number, adding it before the extension\n", batch->output);
+    
+    for (j=0 ; j<ny ; ++j) for (i=0 ; i<nx ; ++i, ++k)
+    {
+        // Interpolate c along the path (ny == 0) or across the grid
+        re = creal(batch->c) + (nx > 1 ? (creal(batch->c_end) - creal(batch->c)) * i / (nx-1) : 0);
+        if (batch->ny > 0) im = cimag(batch->c) + (ny > 1 ? (cimag(batch->c_end) - cimag(batch->c)) * j / (ny-1) : 0);
+        else im = cimag(batch->c) + (nx > 1 ? (cimag(batch->c_end) - cimag(batch->c)) * i / (nx-1) : 0);
+        
+        set_function(batch->function_mode, re + im*I, &a, &b, &c, &d);
+        generate_fractal(frame[k%2], W, H, batch->scaling_factor * REFERENCE_WIDTH / W, 0, 0, a, b, c, d,
+                batch->colour_mode, batch->invert_colour, batch->reverse_template, 0);
+        
+        // Hand the frame to the writer once it has finished the previous one
+        SDL_SemWait(writer.idle);
+        writer.pixels = frame[k%2];
+        frame_filename(writer.filename, sizeof(writer.filename), batch->output, k);
+        SDL_SemPost(writer.go);
+        
+        fprintf(stderr, "Frame %d: c = %lf%+lfi -> %s\n", k, re, im, writer.filename);
+    }
+    
+    // Wait for the last frame to be written
+    SDL_SemWait(writer.idle);
+    writer.quit = 1;
+    SDL_SemPost(writer.go);
+    SDL_WaitThread(thread, NULL);
+    
+    fprintf(stderr, "Rendered %d frames in %.1f s (%d write errors)\n", k, (SDL_GetTicks() - start_time)/1000.0, writer.errors);
+    free(frame[0]);
+    free(frame[1]);
+    return writer.errors ? 1 : 0;
+}
+
+//
+// Animation export. The keyframe file has one keyframe per line,
+//
+//   time function_mode c_re c_im scaling_factor [centre_re centre_im]
+//
+// with times in seconds in increasing order ('#' starts a comment line).
+// Between keyframes c and the centre are interpolated linearly and the
+// scaling factor geometrically, so that zooms run at a steady rate. Where
+// the function mode changes, frames cross-fade from the old mode to the new.
+//
+// Each worker thread renders whole frames on its own, so frames finish out
+// of order. They pass through a reorder queue of ANIMATION_QUEUE frames per
+// worker to the main thread, which writes them in order to the standard
+// input of the encoder as raw BGRA video. A worker only starts a frame that
+// has a free slot in the queue, so memory stays bounded however far ahead
+// of the encoder the workers get.
+//
+#define ANIMATION_QUEUE 2
+
+typedef struct
+{
+    double time;
+    int function_mode;
+    complex double c, centre;
+    double scaling_factor;
+} keyframe;
+
+typedef struct
+{
+    fractal_job job;    // frame parameters and iteration buffers
+    reference_orbit orbit; // for deep zooms
+    Uint32 *fade;       // the new mode's image during a cross-fade
+    SDL_Thread *thread;
+} animation_worker;
+
+struct
+{
+    keyframe *key;
+    int keys, frames;
+    double fps;
+    Uint32 **slot;      // frame k is rendered into slot[k % slots]
+    int *ready;         // the slot holds its rendered frame
+    int slots;
+    int next;           // next frame to start
+    int written;        // frames written to the encoder
+    int quit;           // stop starting frames
+    SDL_mutex *lock;
+    SDL_cond *slot_free, *frame_ready;
+} animator;
+
+int read_keyframes(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    char line[256];
+    keyframe k;
+    double c_re, c_im, centre_re, centre_im;
+    int fields;
+    
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open keyframe file %s\n", filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#') continue;
+        centre_re = centre_im = 0;
+        fields = sscanf(line, "%lf %d %lf %lf %lf %lf %lf", &k.time, &k.function_mode, &c_re, &c_im, &k.scaling_factor, &centre_re, &centre_im);
+        if (fields < 5 || k.function_mode < 0 || k.function_mode > 3 || k.scaling_factor <= 0
+                || (animator.keys > 0 && k.time <= animator.key[animator.keys-1].time))
+        {
+            fprintf(stderr, "%s: bad keyframe: %s", filename, line);
+            fclose(f);
+            return -1;
+        }
+        k.c = c_re + c_im*I;
+        k.centre = centre_re + centre_im*I;
+        animator.key = realloc(animator.key, (animator.keys+1)*sizeof(keyframe));
+        animator.key[animator.keys++] = k;
+    }
+    fclose(f);
+    
+    if (animator.keys == 0)
+    {
+        fprintf(stderr, "%s: no keyframes\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Mix weight/256 of q into p
+void cross_fade(Uint32 *p, const Uint32 *q, int count, Uint32 weight)
+{
+    int i;
+    for (i=0 ; i<count ; ++i)
+    {
+        Uint32 rb = ((p[i] & 0xff00ff)*(256-weight) + (q[i] & 0xff00ff)*weight) >> 8;
+        Uint32 g = ((p[i] & 0xff00)*(256-weight) + (q[i] & 0xff00)*weight) >> 8;
+        p[i] = 0xff000000 | (rb & 0xff00ff) | (g & 0xff00);
+    }
+}
+
+// Render one view of the animation into p
+void render_view(animation_worker *wk, Uint32 *p, int function_mode, complex double c, complex double centre, double scaling_factor)
+{
+    fractal_job *f = &wk->job;
+    
+    set_function(function_mode, c, &f->a, &f->b, &f->c, &f->d);
+    f->p = p;
+    f->px = scaling_factor * REFERENCE_WIDTH / W;
+    f->centre = centre;
+    prepare_deep_zoom(f, &wk->orbit);
+    render_frame(f);
+}
+
+// Render frame k, at time k/fps, into p
+void render_animation_frame(animation_worker *wk, int k, Uint32 *p)
+{
+    double t = k / animator.fps, u = 0, scaling_factor;
+    complex double c, centre;
+    keyframe *k0, *k1;
+    int i;
+    
+    // Find the keyframes either side of t
+    for (i=0 ; i+1<animator.keys && animator.key[i+1].time <= t ; ++i);
+    k0 = &animator.key[i];
+    k1 = i+1 < animator.keys ? &animator.key[i+1] : k0;
+    if (k1 != k0) u = (t - k0->time) / (k1->time - k0->time);
+    
+    c = k0->c + u*(k1->c - k0->c);
+    centre = k0->centre + u*(k1->centre - k0->centre);
+    scaling_factor = k0->scaling_factor * pow(k1->scaling_factor / k0->scaling_factor, u);
+    
+    render_view(wk, p, k0->function_mode, c, centre, scaling_factor);
+    if (k1->function_mode != k0->function_mode && u > 0)
+    {
+        render_view(wk, wk->fade, k1->function_mode, c, centre, scaling_factor);
+        cross_fade(p, wk->fade, W*H, (Uint32)(256*u));
+    }
+}
+
+int animation_thread(void *data)
+{
+    animation_worker *wk = data;
+    int k;
+    
+    while (1)
+    {
+        // Take the next frame once its slot in the reorder queue is free
+        SDL_LockMutex(animator.lock);
+        while (!animator.quit && animator.next < animator.frames && animator.next >= animator.written + animator.slots)
+            SDL_CondWait(animator.slot_free, animator.lock);
+        if (animator.quit || animator.next >= animator.frames)
+        {
+            SDL_UnlockMutex(animator.lock);
+            break;
+        }
+        k = animator.next++;
+        SDL_UnlockMutex(animator.lock);
+        
+        render_animation_frame(wk, k, animator.slot[k % animator.slots]);
+        
+        SDL_LockMutex(animator.lock);
+        animator.ready[k % animator.slots] = 1;
+        SDL_CondBroadcast(animator.frame_ready);
+        SDL_UnlockMutex(animator.lock);
+    }
+    return 0;
+}
+
+int run_animation(const batch_settings *batch, const animation_settings *animation)
+{
+    char pipe_command[1024];
+    FILE *pipe;
+    animation_worker *worker;
+    int workers, i, k, errors = 0, status;
+    Uint32 start_time, report_time;
+    
+    if (read_keyframes(animation->keyframe_file) < 0) return 1;
+    animator.fps = animation->fps;
+    animator.frames = (int)(animator.key[animator.keys-1].time * animator.fps) + 1;
+    
+    // Start the encoder
+    if (animation->encoder) snprintf(pipe_command, sizeof(pipe_command), "%s", animation->encoder);
+    else snprintf(pipe_command, sizeof(pipe_command), "ffmpeg -y -loglevel error -f rawvideo -pixel_format bgra -video_size %dx%d "
+            "-framerate %g -i - -pix_fmt yuv420p '%s'", W, H, animator.fps, animation->video_file);
+    fprintf(stderr, "Opening pipe:\n%s\n", pipe_command);
+    signal(SIGPIPE, SIG_IGN); // a failed encoder shows up as a write error
+    pipe = popen(pipe_command, "w");
+    if (pipe == NULL)
+    {
+        fprintf(stderr, "Could not start the encoder\n");
+        return 1;
+    }
+    
+    // Everything the workers share is set up before they start
+    if (shade_row == NULL) select_kernel(NULL);
+    if (palette_iterations != max_iterations) build_palettes();
+    get_template_mip(batch->reverse_template);
+    if (batch->colour_mode == 4) get_template_distance(batch->reverse_template);
+    
+    workers = SDL_GetCPUCount();
+    if (workers < 1) workers = 1;
+    if (workers > animator.frames) workers = animator.frames;
+    animator.slots = ANIMATION_QUEUE * workers;
+    animator.slot = malloc(animator.slots * sizeof(Uint32 *));
+    animator.ready = calloc(animator.slots, sizeof(int));
+    for (i=0 ; i<animator.slots ; ++i) animator.slot[i] = simd_alloc(W*H*sizeof(Uint32));
+    animator.lock = SDL_CreateMutex();
+    animator.slot_free = SDL_CreateCond();
+    animator.frame_ready = SDL_CreateCond();
+    
+    fprintf(stderr, "Rendering %d frames (%.1f s at %g frames/s) with %d workers\n",
+            animator.frames, animator.key[animator.keys-1].time, animator.fps, workers);
+    start_time = report_time = SDL_GetTicks();
+    worker = calloc(workers, sizeof(animation_worker));
+    for (i=0 ; i<workers ; ++i)
+    {
+        fractal_job *f = &worker[i].job;
+        f->w = W; f->h = H;
+        f->cmode = batch->colour_mode;
+        f->invert_colour = batch->invert_colour;
+        f->reverse_template = batch->reverse_template;
+        f->mask = get_template_mask(batch->reverse_template);
+        f->mip = get_template_mip(batch->reverse_template);
+        f->distance = batch->colour_mode == 4 ? get_template_distance(batch->reverse_template) : NULL;
+        f->it.n = simd_alloc(W*H*sizeof(Uint16));
+        f->it.texel = simd_alloc(W*H*sizeof(Uint32));
+        f->it.aa = aa_samples;
+        worker[i].fade = simd_alloc(W*H*sizeof(Uint32));
+        worker[i].thread = SDL_CreateThread(animation_thread, "animation worker", &worker[i]);
+    }
+    
+    // Write the frames in order as they become ready
+    for (k=0 ; k<animator.frames && !errors ; ++k)
+    {
+        SDL_LockMutex(animator.lock);
+        while (!animator.ready[k % animator.slots]) SDL_CondWait(animator.frame_ready, animator.lock);
+        SDL_UnlockMutex(animator.lock);
+        
+        if (fwrite(animator.slot[k % animator.slots], sizeof(Uint32), W*H, pipe) != (size_t)(W*H))
+        {
+            fprintf(stderr, "Error writing frame %d to the encoder\n", k);
+            errors++;
+        }
+        
+        SDL_LockMutex(animator.lock);
+        animator.ready[k % animator.slots] = 0;
+        animator.written++;
+        if (errors) animator.quit = 1;
+        SDL_CondBroadcast(animator.slot_free);
+        SDL_UnlockMutex(animator.lock);
+        
+        if (SDL_GetTicks() - report_time >= 1000)
+        {
+            fprintf(stderr, "Frame %d of %d, %.1f frames/s\n", k+1, animator.frames, (k+1) * 1000.0 / (SDL_GetTicks() - start_time));
+            report_time = SDL_GetTicks();
+        }
+    }
+    
+    for (i=0 ; i<workers ; ++i) SDL_WaitThread(worker[i].thread, NULL);
+    status = pclose(pipe);
+    fprintf(stderr, "Encoded %d frames in %.1f s (%.1f frames/s), encoder exit value is %d\n",
+            animator.written - errors, (SDL_GetTicks() - start_time)/1000.0,
+            (animator.written - errors) * 1000.0 / (SDL_GetTicks() - start_time + 1), status);
+    
+    for (i=0 ; i<workers ; ++i)
+    {
+        free(worker[i].job.it.n);
+        free(worker[i].job.it.texel);
+        free(worker[i].job.it.edge);
+        free(worker[i].job.it.edge_n);
+        free(worker[i].job.it.edge_texel);
+        free(worker[i].job.tile_done);
+        free(worker[i].job.band);
+        free_reference_orbit(&worker[i].orbit);
+        free(worker[i].fade);
+    }
+    for (i=0 ; i<animator.slots ; ++i) free(animator.slot[i]);
+    free(animator.slot);
+    free(animator.ready);
+    free(worker);
+    free(animator.key);
+    SDL_DestroyCond(animator.slot_free);
+    SDL_DestroyCond(animator.frame_ready);
+    SDL_DestroyMutex(animator.lock);
+    return errors || status ? 1 : 0;
+}
+
+//
+// Benchmark. Every scene (function mode, zoom, template polarity and
+// template set) is rendered repeat times from scratch, and the time per
+// frame, pixel and iteration rates and a checksum of the output are
+// reported. The checksums do not depend on the kernel or the number of
+// threads, so they show whether a change to the renderer alters its output.
+//
+
+// Hash the frame buffer (FNV-1a)
+Uint64 frame_checksum(const Uint32 *pixels, int size, Uint64 hash)
+{
+    int i;
+    for (i=0 ; i<size ; ++i)
+    {
+        hash ^= pixels[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+int compare_times(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Synthetic stand-in for templates captured from a camera: a noisy
+// silhouette on a textured background, so that the template lookups and
+// alpha tests see realistic variation rather than flat colour
+void camera_templates()
+{
+    int n, x, y;
+    unsigned int r = 12345;
+    double dx, dy;
+    
+    for (n=0 ; n<2 ; ++n) for (y=0 ; y<template_h ; ++y) for (x=0 ; x<template_w ; ++x)
+    {
+        r = r*1103515245 + 12345;
+        dx = (x - template_w/2) / (0.3*template_w);
+        dy = (y - template_h*(n ? 0.6 : 0.45)) / (0.4*template_h);
+        TEMPLATE_PIXEL(n, y, x)[0] = (x*3 + (r>>16)%32) & 255;                // blue
+        TEMPLATE_PIXEL(n, y, x)[1] = (y*2 + (r>>20)%32) & 255;                // green
+        TEMPLATE_PIXEL(n, y, x)[2] = ((x^y) + 64*n) & 255;                    // red
+        TEMPLATE_PIXEL(n, y, x)[3] = dx*dx + dy*dy < 1 + ((r>>24)%16)/64.0 ? 255 : 0; // alpha
+    }
+}
+
+int run_benchmark(int repeat, int have_templates)
+{
+    static const double zooms[] = {0.005, 0.002, 0.0005};
+    static const char *template_names[] = {"flat", "camera"};
+    unsigned char *camera = malloc(template_bytes);
+    Uint32 *frame = simd_alloc(W*H*sizeof(Uint32));
+    double *times = malloc(repeat*sizeof(double));
+    double *all_times = malloc(4*3*2*2*repeat*sizeof(double));
+    double total_time = 0, total_iterations = 0, iterations, scene_time;
+    int mode, zoom, reverse, set, i, k, frames = 0;
+    Uint64 start, hash, total_hash = 14695981039346656037ull;
+    complex double a, b, c, d;
+    
+    // Use the templates given on the command line as the camera set
+    if (!have_templates) camera_templates();
+    memcpy(camera, template[0], template_bytes);
+    
+    // Warm up the thread pool and palettes
+    set_function(0, 0.7+0.3*I, &a, &b, &c, &d);
+    generate_fractal(frame, W, H, zooms[0] * REFERENCE_WIDTH / W, 0, 0, a, b, c, d, 0, 0, 0, 0);
+    
+    printf("%-6s %-4s %-9s %-7s %9s %9s %9s %9s %16s\n",
+            "tmpl", "mode", "zoom", "reverse", "p50 ms", "p99 ms", "Mpix/s", "Miter/s", "checksum");
+    for (set=0 ; set<2 ; ++set)
+    {
+        if (set == 0) flat_templates();
+        else memcpy(template[0], camera, template_bytes);
+        
+        for (mode=0 ; mode<4 ; ++mode) for (zoom=0 ; zoom<3 ; ++zoom) for (reverse=0 ; reverse<2 ; ++reverse)
+        {
+            // As in the interactive mode, c scales with the zoom
+            set_function(mode, zooms[zoom] * (140+60*I), &a, &b, &c, &d);
+            scene_time = 0;
+            for (k=0 ; k<repeat ; ++k)
+            {
+                // A new template generation makes every repeat a full render
+                template_generation++;
+                start = SDL_GetPerformanceCounter();
+                generate_fractal(frame, W, H, zooms[zoom] * REFERENCE_WIDTH / W, 0, 0, a, b, c, d, 0, 0, reverse, 0);
+                times[k] = 1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+                all_times[frames++] = times[k];
+                scene_time += times[k];
+            }
+            
+            iterations = 0;
+            for (i=0 ; i<W*H ; ++i) iterations += last_frame.n[i] < max_iterations ? last_frame.n[i] : max_iterations;
+            hash = frame_checksum(frame, W*H, 14695981039346656037ull);
+            total_hash = frame_checksum(frame, W*H, total_hash);
+            total_time += scene_time;
+            total_iterations += iterations * repeat;
+            
+            qsort(times, repeat, sizeof(double), compare_times);
+            printf("%-6s %-4d %-9g %-7d %9.2f %9.2f %9.1f %9.1f %016llx\n",
+                    template_names[set], mode, zooms[zoom], reverse,
+                    times[repeat/2], times[(repeat*99)/100],
+                    W*H*repeat / (scene_time * 1000), iterations*repeat / (scene_time * 1000),
+                    (unsigned long long)hash);
+        }
+    }
+    
+    qsort(all_times, frames, sizeof(double), compare_times);
+    printf("Total: %d frames, p50 %.2f ms, p99 %.2f ms, %.1f Mpixels/s, %.1f Miterations/s, checksum %016llx\n",
+            frames, all_times[frames/2], all_times[(frames*99)/100],
+            (double)W*H*frames / (total_time * 1000), total_iterations / (total_time * 1000),
+            (unsigned long long)total_hash);
+    
+    free(camera); free(frame); free(times); free(all_times);
+    return 0;
+}
+
+// Allocate templates of w x h pixels. Returns -1 if the size is not a
+// power of two of at least 8 in each direction.
+int set_template_size(int w, int h)
+{
+    unsigned char *front, *back;
+    size_t bytes;
+    
+    if (w < 8 || h < 8 || w > 16384 || h > 16384 || (w & (w-1)) || (h & (h-1)))
+    {
+        fprintf(stderr, "Template size must be a power of two from 8 to 16384 in each direction\n");
+        return -1;
+    }
+    
+    // Keep the old templates if the new ones cannot be allocated
+    bytes = (size_t)2*4*w*h;
+    front = realloc(template[0], bytes);
+    if (front) template[0] = front;
+    back = front ? realloc(template_back, bytes) : NULL;
+    if (back) template_back = back;
+    if (front == NULL || back == NULL)
+    {
+        fprintf(stderr, "Out of memory for %d x %d templates\n", w, h);
+        return -1;
+    }
+    
+    template_w = w; template_h = h;
+    template_bytes = bytes;
+    for (template_w_bits=0 ; (1<<template_w_bits) < w ; ++template_w_bits);
+    for (template_h_bits=0 ; (1<<template_h_bits) < h ; ++template_h_bits);
+    template[1] = template[0] + template_bytes/2;
+    template_mask_generation[0] = template_mask_generation[1] = -1;
+    template_distance_generation[0] = template_distance_generation[1] = -1;
+    template_generation++;
+    return 0;
+}
+
+// Build the alpha mask for one template polarity of the templates at
+// pixels (laid out as template[0]) in *mask
+void build_template_mask(Uint64 **mask, const unsigned char *pixels, int reverse_template)
+{
+    int n, x, y, r, alpha;
+    size_t words = template_bytes/4/64;
+    
+    *mask = realloc(*mask, words*sizeof(Uint64));
+    memset(*mask, 0, words*sizeof(Uint64));
+    for (n=0 ; n<2 ; ++n) for (y=0 ; y<template_h ; ++y) for (x=0 ; x<template_w ; ++x)
+    {
+        r = n*template_h + y;
+        alpha = pixels[4*((size_t)r*template_w + x) + 3];
+        if (reverse_template ? alpha < 127 : alpha > 127)
+            (*mask)[((r >> 3) << (template_w_bits - 3)) + (x >> 3)] |= (Uint64)1 << (((r & 7) << 3) + (x & 7));
+    }
+}
+
+// Build the mip levels of mask in *mip
+void build_template_mip(unsigned char **mip, const Uint64 *mask)
+{
+    int k, x, y, cols, rows, size = 0, top = template_w_bits < template_h_bits ? template_w_bits : template_h_bits;
+    unsigned char *level, *below;
+    
+    for (k=3 ; k<=top ; ++k) size += (2*template_h >> k)*(template_w >> k);
+    *mip = realloc(*mip, size);
+    
+    // Level 3 has a block per mask word, in the same order
+    level = *mip;
+    for (x=0 ; x<2*template_h/8*template_w/8 ; ++x) level[x] = mask[x] != 0;
+    
+    for (k=4 ; k<=top ; ++k)
+    {
+        below = level;
+        level += (2*template_h >> (k-1))*(template_w >> (k-1));
+        cols = template_w >> k;
+        rows = 2*template_h >> k;
+        for (y=0 ; y<rows ; ++y) for (x=0 ; x<cols ; ++x)
+            level[y*cols + x] = below[2*y*2*cols + 2*x] | below[2*y*2*cols + 2*x+1] | below[(2*y+1)*2*cols + 2*x] | below[(2*y+1)*2*cols + 2*x+1];
+    }
+}
+
+// Return the alpha mask for one template polarity, first rebuilding it if
+// the templates have changed since it was built
+const Uint64 *get_template_mask(int reverse_template)
+{
+    if (template_mask_generation[reverse_template] != template_generation)
+    {
+        build_template_mask(&template_mask[reverse_template], template[0], reverse_template);
+        build_template_mip(&template_mip[reverse_template], template_mask[reverse_template]);
+        template_mask_generation[reverse_template] = template_generation;
+    }
+    return template_mask[reverse_template];
+}
+
+// Return the mip levels of the mask for one template polarity
+const unsigned char *get_template_mip(int reverse_template)
+{
+    get_template_mask(reverse_template);
+    return template_mip[reverse_template];
+}
+
+// The distance field is built in two passes over tiles of TILE_ROWS rows
+// of both templates. The first finds the distance along each row to the
+// nearest texel in the mask and outside it, up to DISTANCE_RANGE + 1. As
+// the field only reaches DISTANCE_RANGE, the second can then take the
+// nearest of the rows within DISTANCE_RANGE above and below.
+typedef struct
+{
+    const Uint64 *mask;
+    float *distance;
+    unsigned char *row_out, *row_in; // distances along the rows to the mask and outside it
+    int pass;
+} distance_job;
+
+void distance_tile(void *job, int tile, int thread)
+{
+    distance_job *j = job;
+    int r, x, y, dy, q, d_out, d_in, far = DISTANCE_RANGE + 1;
+    int *best_out = malloc(2*template_w*sizeof(int)), *best_in = best_out + template_w;
+    unsigned char *out, *in;
+    
+    for (r=tile*TILE_ROWS ; r<(tile+1)*TILE_ROWS ; ++r)
+    {
+        out = j->row_out + r*template_w;
+        in = j->row_in + r*template_w;
+        if (j->pass == 0)
+        {
+            d_out = d_in = far;
+            for (x=0 ; x<template_w ; ++x)
+            {
+                if (template_hit(j->mask, r, x)) {d_out = 0; d_in = d_in < far ? d_in + 1 : far;}
+                else {d_in = 0; d_out = d_out < far ? d_out + 1 : far;}
+                out[x] = d_out;
+                in[x] = d_in;
+            }
+            for (x=template_w-1 ; x>=0 ; --x)
+            {
+                d_out = out[x] == 0 ? 0 : d_out < far ? d_out + 1 : far;
+                d_in = in[x] == 0 ? 0 : d_in < far ? d_in + 1 : far;
+                if (d_out < out[x]) out[x] = d_out;
+                if (d_in < in[x]) in[x] = d_in;
+            }
+        }
+        else
+        {
+            // Rows of the same template within range
+            y = r % template_h;
+            for (x=0 ; x<template_w ; ++x) best_out[x] = best_in[x] = far*far;
+            for (dy=-DISTANCE_RANGE ; dy<=DISTANCE_RANGE ; ++dy)
+            {
+                q = y + dy;
+                if (q < 0 || q >= template_h) continue;
+                q = (r - y + q)*template_w;
+                for (x=0 ; x<template_w ; ++x)
+                {
+                    d_out = j->row_out[q + x]*j->row_out[q + x] + dy*dy;
+                    d_in = j->row_in[q + x]*j->row_in[q + x] + dy*dy;
+                    best_out[x] = d_out < best_out[x] ? d_out : best_out[x];
+                    best_in[x] = d_in < best_in[x] ? d_in : best_in[x];
+                }
+            }
+            for (x=0 ; x<template_w ; ++x)
+            {
+                d_out = best_out[x] < DISTANCE_RANGE*DISTANCE_RANGE ? best_out[x] : DISTANCE_RANGE*DISTANCE_RANGE;
+                d_in = best_in[x] < DISTANCE_RANGE*DISTANCE_RANGE ? best_in[x] : DISTANCE_RANGE*DISTANCE_RANGE;
+                j->distance[r*template_w + x] = out[x] == 0 ? -sqrtf(d_in) : sqrtf(d_out);
+            }
+        }
+    }
+    free(best_out);
+}
+
+// Build the distance field of mask in *distance
+void build_template_distance(float **distance, const Uint64 *mask)
+{
+    distance_job j = {mask, NULL, malloc(2*2*template_w*template_h), NULL, 0};
+    
+    *distance = realloc(*distance, 2*template_w*template_h*sizeof(float));
+    j.distance = *distance;
+    j.row_in = j.row_out + 2*template_w*template_h;
+    parallel_tiles(distance_tile, &j, 2*template_h/TILE_ROWS);
+    j.pass = 1;
+    parallel_tiles(distance_tile, &j, 2*template_h/TILE_ROWS);
+    free(j.row_out);
+}
+
+// Return the distance field for one template polarity, first rebuilding it
+// if the templates have changed since it was built
+const float *get_template_distance(int reverse_template)
+{
+    const Uint64 *mask = get_template_mask(reverse_template);
+    
+    if (template_distance_generation[reverse_template] != template_generation)
+    {
+        build_template_distance(&template_distance[reverse_template], mask);
+        template_distance_generation[reverse_template] = template_generation;
+    }
+    return template_distance[reverse_template];
+}
+
+// Make template n of the back buffer current, keeping the other template.
+// Only called from the main thread between frames, when no tile is
+// reading the templates. The other template is copied here rather than
+// by the segmentation thread, because the main thread may have changed
+// it since the back buffer was filled.
+void swap_templates(int n)
+{
+    unsigned char *front = template[0];
+    
+    memcpy(template_back + template_bytes/2*(1-n), template[1-n], template_bytes/2);
+    template[0] = template_back;
+    template[1] = template[0] + template_bytes/2;
+    template_back = front;
+    template_generation++;
+}
+
+// Fill the templates with flat colours: white (template 1) and black (template 2)
+void flat_templates()
+{
+    int x, y;
+    for (y=0 ; y<template_h ; ++y) for (x=0 ; x<template_w ; ++x)
+    {
+        TEMPLATE_PIXEL(0, y, x)[0] = 255; // blue
+        TEMPLATE_PIXEL(0, y, x)[1] = 255; // green
+        TEMPLATE_PIXEL(0, y, x)[2] = 255; // red
+        TEMPLATE_PIXEL(0, y, x)[3] = 255; // alpha
+        TEMPLATE_PIXEL(1, y, x)[0] = 0;   // blue     
+        TEMPLATE_PIXEL(1, y, x)[1] = 0;   // green
+        TEMPLATE_PIXEL(1, y, x)[2] = 0;   // red
+        TEMPLATE_PIXEL(1, y, x)[3] = 255; // alpha
+    }
+    template_generation++;
+}
+
+// Load a PNG image into template n, scaling it to template_w x template_h
+int load_template(int n, const char *filename)
+{
+    cairo_surface_t *image = cairo_image_surface_create_from_png(filename);
+    int x, y, w, h, stride, alpha;
+    unsigned char *data, *s;
+    cairo_format_t format;
+    
+    if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS)
+    {
+        fprintf(stderr, "Could not load template image %s: %s\n", filename, cairo_status_to_string(cairo_surface_status(image)));
+        cairo_surface_destroy(image);
+        return -1;
+    }
+    
+    // Convert images that cairo loads in other formats (A8, A1, or
+    // floating point for 16-bit PNGs) by painting them onto an ARGB image
+    format = cairo_image_surface_get_format(image);
+    if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)
+    {
+        cairo_surface_t *argb = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                cairo_image_surface_get_width(image), cairo_image_surface_get_height(image));
+        cairo_t *cr = cairo_create(argb);
+        cairo_set_source_surface(cr, image, 0, 0);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        cairo_surface_destroy(image);
+        image = argb;
+        format = CAIRO_FORMAT_ARGB32;
+        if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS)
+        {
+            fprintf(stderr, "Could not convert template image %s: %s\n", filename, cairo_status_to_string(cairo_surface_status(image)));
+            cairo_surface_destroy(image);
+            return -1;
+        }
+    }
+    
+    // Cairo images are premultiplied ARGB, so divide the colours by alpha
+    cairo_surface_flush(image);
+    w = cairo_image_surface_get_width(image);
+    h = cairo_image_surface_get_height(image);
+    stride = cairo_image_surface_get_stride(image);
+    data = cairo_image_surface_get_data(image);
+    for (y=0 ; y<template_h ; ++y) for (x=0 ; x<template_w ; ++x)
+    {
+        s = data + (y*h/template_h)*stride + 4*(x*w/template_w);
+        alpha = format == CAIRO_FORMAT_ARGB32 ? s[3] : 255;
+        TEMPLATE_PIXEL(n, y, x)[0] = alpha ? s[0]*255/alpha : 0; // blue
+        TEMPLATE_PIXEL(n, y, x)[1] = alpha ? s[1]*255/alpha : 0; // green
+        TEMPLATE_PIXEL(n, y, x)[2] = alpha ? s[2]*255/alpha : 0; // red
+        TEMPLATE_PIXEL(n, y, x)[3] = alpha;
+    }
+    
+    cairo_surface_destroy(image);
+    template_generation++;
+    fprintf(stderr, "Loaded template %d from %s (%d x %d)\n", n+1, filename, w, h);
+    return 0;
+}
+
+// Save template n as a PNG image, which load_template reads back unchanged
+int save_template(int n, const char *filename)
+{
+    cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, template_w, template_h);
+    int x, y, stride = cairo_image_surface_get_stride(image), status;
+    unsigned char *data = cairo_image_surface_get_data(image), *d, *s;
+
+    // Cairo images are premultiplied ARGB
+    for (y=0 ; y<template_h ; ++y) for (x=0 ; x<template_w ; ++x)
+    {
+        s = TEMPLATE_PIXEL(n, y, x);
+        d = data + y*stride + 4*x;
+        d[0] = (s[0]*s[3] + 127)/255;
+        d[1] = (s[1]*s[3] + 127)/255;
+        d[2] = (s[2]*s[3] + 127)/255;
+        d[3] = s[3];
+    }
+    cairo_surface_mark_dirty(image);
+    status = cairo_surface_write_to_png(image, filename);
+    cairo_surface_destroy(image);
+
+    if (status != CAIRO_STATUS_SUCCESS)
+    {
+        fprintf(stderr, "Could not save template image %s: %s\n", filename, cairo_status_to_string(status));
+        return -1;
+    }
+    fprintf(stderr, "Saved template %d to %s\n", n+1, filename);
+    return 0;
+}
+
+// Save both templates to the "templates" directory, named by the time
+void save_templates()
+{
+    char filename[64];
+    time_t rawtime;
+    struct tm t;
+    int n;
+
+    mkdir("templates", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    time(&rawtime);
+    localtime_r(&rawtime, &t);
+    for (n=0 ; n<2 ; ++n)
+    {
+        snprintf(filename, sizeof(filename), "templates/%04d_%02d_%02d_%02d-%02d-%02d_%d.png",
+                1900 + t.tm_year, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, n+1);
+        save_template(n, filename);
+    }
+}
+
+//
+// Session file: the view and the templates, so that a restart carries on
+// where the program left off instead of with flat templates. The file is
+// a header page followed by SESSION_HISTORY slots, each holding a pair of
+// templates laid out as template[0]. The slots form a ring of the most
+// recent template pairs; the current templates are always in one of them.
+// The file is mapped into memory for the whole run: the header and slots
+// are updated in place, and the kernel writes them back. Slots that have
+// never been used are holes in the file, so it only takes up the disk
+// space of the templates it holds.
+//
+#define SESSION_MAGIC "FRKTSES1"
+#define SESSION_HISTORY 8
+#define SESSION_HEADER 4096 // bytes before the first slot, a page so that slots stay aligned
+
+typedef struct
+{
+    char magic[8];
+    Sint32 template_w, template_h;
+    Sint32 history;          // slots in use
+    Sint32 newest, current;  // slot of the newest templates and of the current ones
+    session_view view;
+} session_header;
+
+struct
+{
+    session_header *header;  // the mapped file, or NULL without a session
+    size_t size;
+    int generation;          // template_generation when the current slot was last stored
+} session;
+
+unsigned char *session_slot(int slot)
+{
+    return (unsigned char *)session.header + SESSION_HEADER + slot*template_bytes;
+}
+
+// Open or create the session file and map it. If it holds a session for
+// templates of the current size, the templates are copied from it, view
+// is filled in and 1 is returned. Returns 0 for a new session, or -1 if
+// the file cannot be used, in which case the program runs without one.
+int open_session(const char *filename, session_view *view)
+{
+    size_t size = SESSION_HEADER + SESSION_HISTORY*template_bytes;
+    session_header *h;
+    struct stat st;
+    int fd, restored;
+
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Could not open session file %s: %s\n", filename, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size != size && ftruncate(fd, size) < 0)
+    {
+        fprintf(stderr, "Could not resize session file %s: %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map session file %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    session.header = h;
+    session.size = size;
+
+    restored = (size_t)st.st_size == size && memcmp(h->magic, SESSION_MAGIC, 8) == 0
+            && h->template_w == template_w && h->template_h == template_h
+            && h->history >= 1 && h->history <= SESSION_HISTORY
+            && h->current >= 0 && h->current < h->history && h->newest >= 0 && h->newest < h->history;
+    if (restored)
+    {
+        memcpy(template[0], session_slot(h->current), template_bytes);
+        template_generation++;
+        *view = h->view;
+        fprintf(stderr, "Restored session from %s (%d templates in history)\n", filename, h->history);
+    }
+    else
+    {
+        // Start a new session with the current templates
+        memset(h, 0, sizeof(session_header));
+        memcpy(h->magic, SESSION_MAGIC, 8);
+        h->template_w = template_w;
+        h->template_h = template_h;
+        h->history = 1;
+        memcpy(session_slot(0), template[0], template_bytes);
+        fprintf(stderr, "Started new session in %s\n", filename);
+    }
+    session.generation = template_generation;
+    return restored;
+}
+
+// Store the view in the session
+void save_view(const session_view *view)
+{
+    if (session.header) session.header->view = *view;
+}
+
+// Store the templates in the session if they have changed since they
+// were last stored or recalled. New templates go into a new slot, so the
+// ones they replace stay in the history.
+void store_templates()
+{
+    session_header *h = session.header;
+
+    if (h == NULL || session.generation == template_generation) return;
+    session.generation = template_generation;
+    if (memcmp(session_slot(h->current), template[0], template_bytes) == 0) return;
+
+    h->newest = (h->newest + 1) % SESSION_HISTORY;
+    if (h->history < SESSION_HISTORY) h->history++;
+    memcpy(session_slot(h->newest), template[0], template_bytes);
+    h->current = h->newest;
+}
+
+// Step back to the templates stored before the current ones, or from the
+// oldest to the newest. The current templates are stored first.
+void recall_templates()
+{
+    session_header *h = session.header;
+
+    if (h == NULL) return;
+    store_templates();
+    if (h->history < 2) return;
+
+    h->current = (h->current + h->history - 1) % h->history;
+    memcpy(template[0], session_slot(h->current), template_bytes);
+    template_generation++;
+    session.generation = template_generation;
+    fprintf(stderr, "Templates from history: %d of %d\n", (h->newest - h->current + h->history) % h->history + 1, h->history);
+}
+
+// Store the view and templates and unmap the session file
+void close_session(const session_view *view)
+{
+    if (session.header == NULL) return;
+    save_view(view);
+    store_templates();
+    msync(session.header, session.size, MS_SYNC);
+    munmap(session.header, session.size);
+    session.header = NULL;
+}
+
+// Cards are printed by a worker thread, so the display keeps running while
+// the PostScript is written and sent to CUPS. print_card() queues a job
+// holding the frame parameters and a snapshot of the templates. Jobs share
+// the snapshot until the templates change, so the templates are only
+// copied once for a run of prints. Jobs are queued in a ring: the main
+// thread adds them at head, the worker finishes them at done, and the main
+// thread reports and frees finished jobs at tail (see print_status).
+#define PRINT_QUEUE_SIZE 4
+typedef struct
+{
+    unsigned char *pixels;      // both templates, laid out as template[0]
+    Uint64 *mask[2];            // alpha masks, built by the worker when needed
+    unsigned char *mip[2];      // their mip levels
+    float *distance[2];         // and distance fields
+    int w, h, generation;
+    int refs;                   // jobs using the snapshot, plus one if it is current
+} template_snapshot;
+
+typedef struct
+{
+    int id;
+    int print_hard_copy;
+    char filename[64];
+    double px;                  // frame parameters, as for generate_fractal
+    complex double centre, centre_lo, a, b, c, d;
+    int cmode, invert_colour, reverse_template;
+    template_snapshot *templates;
+    int failed;
+    char message[256];          // result, reported by print_status
+} print_job;
+
+struct
+{
+    print_job slot[PRINT_QUEUE_SIZE];
+    SDL_atomic_t head, done;    // jobs queued, jobs finished by the worker
+    int tail;                   // finished jobs reported
+    int next_id;
+    SDL_sem *go;
+    SDL_Thread *thread;
+    template_snapshot *templates; // snapshot of the current templates, if any
+    cairo_surface_t *cardback;  // decoded back of card, kept between jobs
+} printer;
+
+void release_snapshot(template_snapshot *t)
+{
+    if (t && --t->refs == 0)
+    {
+        free(t->pixels);
+        free(t->mask[0]);
+        free(t->mask[1]);
+        free(t->mip[0]);
+        free(t->mip[1]);
+        free(t->distance[0]);
+        free(t->distance[1]);
+        free(t);
+    }
+}
+
+// The fractal on a card is rendered again at print resolution: print_width
+// pixels across with the field of view of the frame, and print_aa x
+// print_aa samples per pixel. It is rendered in bands of PRINT_BAND rows,
+// and each band is painted onto the page as soon as it is done, so the
+// iteration results are never held for more than one row per thread.
+int print_width = 4096, print_aa = 1;
+#define PRINT_BAND 64
+typedef struct
+{
+    fractal_job f;              // iteration parameters at sample resolution
+    const unsigned char *templates;
+    int width, aa;              // pixels across, samples per pixel side
+    int y0;                     // first row of the band
+    int first;                  // row of the band that tile 0 renders
+    unsigned char *out;         // band pixels (cairo image data)
+    int stride;
+    struct
+    {
+        int *n;
+        Uint16 *n16;
+        Uint32 *texel, *pixels, *sum;
+    } scratch[MAX_THREADS];     // row buffers of each pool thread
+} print_band;
+
+// Render row tile of a band: iterate and shade its aa sample rows, then
+// average each aa x aa block of samples into a pixel
+void print_band_tile(void *job, int tile, int thread)
+{
+    print_band *b = job;
+    int aa = b->aa, width = b->width, sw = width*aa, i, k, x;
+    int row = b->first + tile;
+    Uint32 *out = (Uint32 *)(b->out + row*b->stride), *pixels, *sum, c;
+    
+    if (b->scratch[thread].n == NULL)
+    {
+        b->scratch[thread].n = malloc(sw*sizeof(int));
+        b->scratch[thread].n16 = malloc(sw*sizeof(Uint16));
+        b->scratch[thread].texel = malloc(sw*sizeof(Uint32));
+        b->scratch[thread].pixels = malloc(sw*sizeof(Uint32));
+        b->scratch[thread].sum = malloc(3*width*sizeof(Uint32));
+    }
+    pixels = aa == 1 ? out : b->scratch[thread].pixels;
+    sum = b->scratch[thread].sum;
+    if (aa > 1) memset(sum, 0, 3*width*sizeof(Uint32));
+    
+    for (i=0 ; i<aa ; ++i)
+    {
+        frame_kernel(&b->f)(&b->f, (b->y0 + row)*aa + i, 0, 1, sw, b->scratch[thread].n, b->scratch[thread].texel);
+        for (k=0 ; k<sw ; ++k) b->scratch[thread].n16[k] = b->scratch[thread].n[k];
+        shade_row(b->scratch[thread].n16, b->scratch[thread].texel, b->templates, b->f.distance, pixels, sw, b->f.cmode, b->f.invert_colour);
+        
+        if (aa > 1) for (k=0 ; k<sw ; ++k)
+        {
+            x = k/aa;
+            sum[3*x+0] += (pixels[k] >> 16) & 255;
+            sum[3*x+1] += (pixels[k] >> 8) & 255;
+            sum[3*x+2] += pixels[k] & 255;
+        }
+    }
+    
+    if (aa > 1) for (x=0 ; x<width ; ++x)
+    {
+        c = 0xff000000;
+        for (i=0 ; i<3 ; ++i) c |= ((sum[3*x+i] + aa*aa/2) / (aa*aa)) << (16 - 8*i);
+        out[x] = c;
+    }
+}
+
+// Render the fractal of a job at width x height pixels and paint it with
+// its top left corner at the origin of cr
+void paint_print_fractal(cairo_t *cr, print_job *job, int width, int height)
+{
+    print_band *b = calloc(1, sizeof(print_band));
+    reference_orbit orbit = {0};
+    template_snapshot *t = job->templates;
+    cairo_surface_t *band;
+    int y0, rows, i, r = job->reverse_template;
+    Uint32 start = SDL_GetTicks();
+    Uint64 stage_start = SDL_GetPerformanceCounter();
+    
+    start_pool();
+    if (t->mask[r] == NULL)
+    {
+        build_template_mask(&t->mask[r], t->pixels, r);
+        build_template_mip(&t->mip[r], t->mask[r]);
+    }
+    if (t->distance[r] == NULL && job->cmode == 4) build_template_distance(&t->distance[r], t->mask[r]);
+    
+    b->width = width;
+    b->aa = print_aa;
+    b->templates = t->pixels;
+    b->f.w = width*print_aa;
+    b->f.h = height*print_aa;
+    b->f.px = job->px * W / b->f.w;
+    b->f.centre = job->centre;
+    b->f.centre_lo = job->centre_lo;
+    b->f.a = job->a; b->f.b = job->b; b->f.c = job->c; b->f.d = job->d;
+    b->f.cmode = job->cmode;
+    b->f.invert_colour = job->invert_colour;
+    b->f.reverse_template = r;
+    b->f.mask = t->mask[r];
+    b->f.mip = t->mip[r];
+    b->f.distance = t->distance[r];
+    prepare_deep_zoom(&b->f, &orbit);
+    
+    for (y0=0 ; y0<height ; y0+=PRINT_BAND)
+    {
+        // Each band but the last has one extra row, overlapped by the next
+        // band, so that no seam shows between them when they are scaled
+        rows = height - y0 < PRINT_BAND ? height - y0 : PRINT_BAND + (height - y0 > PRINT_BAND);
+        band = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, rows);
+        b->out = cairo_image_surface_get_data(band);
+        b->stride = cairo_image_surface_get_stride(band);
+        b->y0 = y0;
+        
+        // A row per thread at a time, so that display frames can use the
+        // pool between them rather than wait for the whole band
+        for (b->first=0 ; b->first<rows ; b->first+=pool.threads)
+            background_tiles(print_band_tile, b, rows - b->first < pool.threads ? rows - b->first : pool.threads);
+        cairo_surface_mark_dirty(band);
+        
+        cairo_set_source_surface(cr, band, 0, y0);
+        cairo_paint(cr);
+        cairo_surface_destroy(band);
+    }
+    
+    for (i=0 ; i<MAX_THREADS ; ++i)
+    {
+        free(b->scratch[i].n); free(b->scratch[i].n16); free(b->scratch[i].texel);
+        free(b->scratch[i].pixels); free(b->scratch[i].sum);
+    }
+    free_reference_orbit(&orbit);
+    free(b);
+    record_stage(METRIC_PRINT, stage_start);
+    fprintf(stderr, "Rendered %d x %d print fractal (%d x %d samples per pixel) in %.1f s\n",
+            width, height, print_aa, print_aa, (SDL_GetTicks() - start)/1000.0);
+}
+
+// Draw the card for a job as PostScript and print it. Runs on the worker
+// thread. Returns -1 on failure, with the reason in job->message.
+int render_card(print_job *job)
+{
+	// Check if "prints" directory exists. If not, create it.
+	struct stat statstruct = {0};
+	stat("prints", &statstruct);
+	if (!(statstruct.st_mode & S_IFDIR))
+	{
+		fprintf(stderr, "Creating 'prints' directory...");
+		mkdir("prints", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+		fprintf(stderr, "Done\n");
+	}
+    
+    const char *filename = job->filename;
+    const int tw = job->templates->w, th = job->templates->h;
+    
+    // A4 width and height in points, from GhostView manual:
+    const double page_width = 595;
+    const double page_height = 842;
+    const double page_margin = 20.0;
+
+    // Create cairo surface and context
+    cairo_surface_t* ps_surface = cairo_ps_surface_create(filename, page_width, page_height);
+    cairo_t *cr = cairo_create(ps_surface);
+
+    // Fractal image at print resolution, with the aspect ratio of the frame
+    int rowstride, y;
+    unsigned char *surface_pixels;
+    const int print_height = (int)((double)print_width*H/W + 0.5);
+
+    cairo_rectangle(cr, page_margin, page_margin, page_width-2.0*page_margin, 0.5*page_height - 2*page_margin);
+    cairo_clip(cr);
+    cairo_new_path(cr); // path "not consumed by clip", as it said in the example code!
+    cairo_translate(cr, page_width/2.0, page_height/4.0);
+    cairo_scale(cr, (0.5*page_height-2.0*page_margin)/print_height, (0.5*page_height-2.0*page_margin)/print_height);
+    cairo_translate(cr, -print_width/2, -print_height/2);
+    paint_print_fractal(cr, job, print_width, print_height);
+    
+    // Draw frame if required
+    const int draw_frame = 0;
+    if (draw_frame)
+    {
+        cairo_identity_matrix (cr);
+        cairo_reset_clip(cr);
+        cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
+        cairo_set_line_width(cr, 3.0);
+        cairo_rectangle(cr, page_margin, page_margin, page_width-2.0*page_margin, 0.5*page_height - 2.0*page_margin);
+        cairo_stroke(cr);
+        cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
+        cairo_set_line_width(cr, 1.0);
+        cairo_rectangle(cr, page_margin, page_margin, page_width-2.0*page_margin, 0.5*page_height - 2.0*page_margin);
+        cairo_stroke(cr);
+    }
+
+    // Draw back of card
+    cairo_identity_matrix (cr);
+    cairo_reset_clip (cr);
+    if (!printer.cardback)
+    {
+        // Decode the image on first use and keep it for later cards
+        printer.cardback = cairo_image_surface_create_from_png ("cardback.png");
+        if (cairo_surface_status(printer.cardback) != CAIRO_STATUS_SUCCESS)
+        {
+            fprintf(stderr, "Could not load cardback.png: %s\n", cairo_status_to_string(cairo_surface_status(printer.cardback)));
+            cairo_surface_destroy(printer.cardback);
+            printer.cardback = NULL;
+        }
+        else fprintf(stderr, "PNG width and height: %d x %d\n",
+                cairo_image_surface_get_width(printer.cardback), cairo_image_surface_get_height(printer.cardback));
+    }
+    if (printer.cardback)
+    {
+        double png_height = cairo_image_surface_get_height (printer.cardback);
+        double png_width = cairo_image_surface_get_width (printer.cardback);
+        cairo_scale (cr, page_width / png_width, page_width / png_width);
+        cairo_translate (cr, 0, png_height);
+        cairo_set_source_surface (cr, printer.cardback, 0, 0);
+        cairo_paint (cr);
+    }
+    
+    // Draw templates on back of card
+    int template_size = 60; 
+    
+    // Print template 0 in lower left corner of rear side of card
+    cairo_surface_t *template_surface0; 
+    template_surface0 = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, tw, th);
+    rowstride = cairo_image_surface_get_stride (template_surface0);
+    surface_pixels = cairo_image_surface_get_data (template_surface0);
+    for (y=0 ; y<th ; ++y) memcpy(surface_pixels+(y*rowstride), job->templates->pixels+4*(size_t)(0*th+y)*tw, tw*4);
+    cairo_surface_mark_dirty (template_surface0);
+    cairo_identity_matrix (cr);
+    cairo_reset_clip (cr);
+    cairo_translate(cr, page_margin, page_height-page_margin-template_size);
+    cairo_scale(cr, template_size*1.0/tw, template_size*1.0/th);
+    cairo_set_source_surface (cr, template_surface0, 0, 0);
+    cairo_paint (cr);
+    
+    // Print template 1 in lower right corner of rear side of card
+    cairo_surface_t *template_surface1; 
+    template_surface1 = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, tw, th);
+    rowstride = cairo_image_surface_get_stride (template_surface1);
+    surface_pixels = cairo_image_surface_get_data (template_surface1);
+    for (y=0 ; y<th ; ++y) memcpy(surface_pixels+(y*rowstride), job->templates->pixels+4*(size_t)(1*th+y)*tw, tw*4);
+    cairo_surface_mark_dirty (template_surface1);
+    cairo_identity_matrix (cr);
+    cairo_reset_clip (cr);
+    cairo_translate(cr, page_width-page_margin-template_size, page_height-page_margin-template_size);
+    cairo_scale(cr, template_size*1.0/tw, template_size*1.0/th);
+    cairo_set_source_surface (cr, template_surface1, 0, 0);
+    cairo_paint (cr);
+
+    // Finish drawing and destroy cairo surface and context
+    cairo_show_page(cr);
+    cairo_destroy(cr);
+    cairo_surface_destroy(template_surface0);
+    cairo_surface_destroy(template_surface1);
+    cairo_surface_flush(ps_surface);
+    cairo_status_t status = cairo_surface_status(ps_surface);
+    cairo_surface_destroy(ps_surface);
+    if (status != CAIRO_STATUS_SUCCESS)
+    {
+        snprintf(job->message, sizeof(job->message), "could not write %s: %s", filename, cairo_status_to_string(status));
+        return -1;
+    }
+    
+    // Make a copy of the output file for debugging
+    char command[1024];
+    snprintf(command, sizeof(command), "cp %s aaa.ps", filename);
+    if (system(command)) fprintf(stderr, "Error copying file to aaa.ps\n");
+    
+    // Print the file
+    if (job->print_hard_copy)
+    {
+        const char *destination = cupsGetDefault();
+        int cups_job = cupsPrintFile(destination, filename, "cairo PS", 0, NULL);
+        if (cups_job == 0)
+        {
+            snprintf(job->message, sizeof(job->message), "saved %s, but printing failed: %s", filename, cupsLastErrorString());
+            return -1;
+        }
+        snprintf(job->message, sizeof(job->message), "saved %s and sent to %s (job %d)", filename, destination ? destination : "default printer", cups_job);
+    }
+    else snprintf(job->message, sizeof(job->message), "saved %s", filename);
+    return 0;
+}
+
+int print_thread(void *data)
+{
+    print_job *job;
+    int done;
+    
+    while (1)
+    {
+        // Each queued job posts once, and stop_printer posts once more
+        SDL_SemWait(printer.go);
+        done = SDL_AtomicGet(&printer.done);
+        if (done == SDL_AtomicGet(&printer.head)) break;
+        
+        job = &printer.slot[done % PRINT_QUEUE_SIZE];
+        job->failed = render_card(job) < 0;
+        SDL_AtomicSet(&printer.done, done + 1);
+    }
+    return 0;
+}
+
+// Queue a card of the frame with the given parameters and the current
+// templates, to be saved in the prints directory and, if print_hard_copy
+// is set, sent to the printer
+void print_card(int print_hard_copy, double px, complex double centre, complex double centre_lo,
+        complex double a, complex double b, complex double c, complex double d,
+        int cmode, int invert_colour, int reverse_template)
+{
+    print_job *job;
+    int head = SDL_AtomicGet(&printer.head);
+    
+    print_status();
+    if (head - printer.tail == PRINT_QUEUE_SIZE)
+    {
+        fprintf(stderr, "Print queue full, card not printed\n");
+        return;
+    }
+    
+    if (palette_iterations != max_iterations) build_palettes();
+    if (!printer.thread)
+    {
+        printer.go = SDL_CreateSemaphore(0);
+        printer.thread = SDL_CreateThread(print_thread, "printer", NULL);
+    }
+    
+    // Snapshot the templates if they have changed since the last card
+    if (!printer.templates || printer.templates->generation != template_generation)
+    {
+        unsigned char *pixels = malloc(template_bytes);
+        if (pixels == NULL)
+        {
+            fprintf(stderr, "Out of memory for template snapshot, card not printed\n");
+            return;
+        }
+        release_snapshot(printer.templates);
+        printer.templates = malloc(sizeof(template_snapshot));
+        printer.templates->w = template_w;
+        printer.templates->h = template_h;
+        printer.templates->generation = template_generation;
+        printer.templates->refs = 1;
+        printer.templates->mask[0] = printer.templates->mask[1] = NULL;
+        printer.templates->mip[0] = printer.templates->mip[1] = NULL;
+        printer.templates->distance[0] = printer.templates->distance[1] = NULL;
+        printer.templates->pixels = pixels;
+        memcpy(printer.templates->pixels, template[0], template_bytes);
+    }
+    
+    job = &printer.slot[head % PRINT_QUEUE_SIZE];
+    job->id = ++printer.next_id;
+    job->print_hard_copy = print_hard_copy;
+    job->px = px;
+    job->centre = centre;
+    job->centre_lo = centre_lo;
+    job->a = a; job->b = b; job->c = c; job->d = d;
+    job->cmode = cmode;
+    job->invert_colour = invert_colour;
+    job->reverse_template = reverse_template;
+    job->templates = printer.templates;
+    job->templates->refs++;
+    
+	// Render date and time as string for filename of postscript file, with
+	// the job number so that cards queued in the same second are all kept
+    time_t rawtime;
+    struct tm t;
+    time(&rawtime);
+    localtime_r(&rawtime, &t);
+    snprintf(job->filename, sizeof(job->filename), "prints/%04d_%02d_%02d_%02d-%02d-%02d_%d.ps",
+                1900 + t.tm_year, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, job->id);
+    
+    SDL_AtomicSet(&printer.head, head + 1);
+    SDL_SemPost(printer.go);
+    fprintf(stderr, "Print job %d queued: %s (%d in queue)\n", job->id, job->filename, head + 1 - printer.tail);
+}
+
+// Report print jobs the worker has finished since the last call, and
+// release their templates. Called from the main loop.
+void print_status()
+{
+    print_job *job;
+    
+    while (printer.tail != SDL_AtomicGet(&printer.done))
+    {
+        job = &printer.slot[printer.tail % PRINT_QUEUE_SIZE];
+        fprintf(stderr, "Print job %d %s: %s\n", job->id, job->failed ? "failed" : "done", job->message);
+        release_snapshot(job->templates);
+        printer.tail++;
+    }
+}
+
+// Wait for queued print jobs to finish, then stop the worker
+void stop_printer()
+{
+    if (!printer.thread) return;
+    
+    if (SDL_AtomicGet(&printer.head) != printer.tail) fprintf(stderr, "Waiting for print jobs...\n");
+    SDL_SemPost(printer.go);
+    SDL_WaitThread(printer.thread, NULL);
+    SDL_DestroySemaphore(printer.go);
+    printer.thread = NULL;
+    print_status();
+    
+    release_snapshot(printer.templates);
+    printer.templates = NULL;
+    if (printer.cardback) cairo_surface_destroy(printer.cardback);
+    printer.cardback = NULL;
+}
+
+// Video frame size. Frames are YUY2, accessed as vp[vy][vx][0] (Y) and
+// vp[vy][vx][1] (U for even vx, V for odd vx).
+#define vw 1280
+#define vh 720
+
+//
+// Camera capture. The source is a V4L2 device, which is streamed through
+// mmap'd buffers so frames are processed where the driver wrote them, or
+// as a fallback an ffmpeg pipe reading the device. A source that is a
+// regular file or a named pipe is replayed as raw YUY2 frames of vw x vh
+// (files loop at the end), so the template screen can be used without a
+// camera. "ffmpeg:DEVICE" forces the ffmpeg pipe.
+//
+const char *camera_source = "/dev/video1";
+
+// Enough buffers for every frame that can be in flight in the template
+// screen pipeline (see update_template) plus one being captured
+#define CAMERA_BUFFERS 8
+typedef struct
+{
+    int fd;                 // V4L2 device, or -1
+    FILE *pipe;             // ffmpeg pipe or replay file, or NULL
+    int is_file;            // replay source can be rewound
+    Uint32 next_frame;      // replay files are paced at 30 frames per second
+    void *buffer[CAMERA_BUFFERS];
+    size_t length[CAMERA_BUFFERS];
+    int buffers;
+    SDL_atomic_t busy[CAMERA_BUFFERS]; // pipe and file buffers handed out
+} camera;
+
+#ifdef HAVE_V4L2
+static int xioctl(int fd, unsigned long request, void *arg)
+{
+    int r;
+    do r = ioctl(fd, request, arg);
+    while (r == -1 && errno == EINTR);
+    return r;
+}
+
+// Open a V4L2 device for mmap streaming of vw x vh YUY2 frames
+int camera_open_v4l2(camera *cam, const char *device)
+{
+    struct v4l2_format fmt;
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int i;
+    
+    cam->fd = open(device, O_RDWR);
+    if (cam->fd < 0) return -1;
+    
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = vw;
+    fmt.fmt.pix.height = vh;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(cam->fd, VIDIOC_S_FMT, &fmt) < 0 || fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV
+            || fmt.fmt.pix.width != vw || fmt.fmt.pix.height != vh || fmt.fmt.pix.bytesperline != vw*2)
+    {
+        fprintf(stderr, "%s cannot capture %dx%d YUYV frames\n", device, vw, vh);
+        goto fail;
+    }
+    
+    memset(&req, 0, sizeof(req));
+    req.count = CAMERA_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(cam->fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2) goto fail;
+    
+    cam->buffers = req.count < CAMERA_BUFFERS ? req.count : CAMERA_BUFFERS;
+    for (i=0 ; i<cam->buffers ; ++i)
+    {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(cam->fd, VIDIOC_QUERYBUF, &buf) < 0) goto fail;
+        cam->length[i] = buf.length;
+        cam->buffer[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cam->fd, buf.m.offset);
+        if (cam->buffer[i] == MAP_FAILED) {cam->buffer[i] = NULL; goto fail;}
+        if (xioctl(cam->fd, VIDIOC_QBUF, &buf) < 0) goto fail;
+    }
+    
+    if (xioctl(cam->fd, VIDIOC_STREAMON, &type) < 0) goto fail;
+    return 0;
+    
+fail:
+    for (i=0 ; i<CAMERA_BUFFERS ; ++i) if (cam->buffer[i]) munmap(cam->buffer[i], cam->length[i]);
+    memset(cam->buffer, 0, sizeof(cam->buffer));
+    close(cam->fd);
+    cam->fd = -1;
+    return -1;
+}
+#endif
+
+// Open the camera source. Returns -1 if no source could be opened.
+int camera_open(camera *cam, const char *source)
+{
+    char pipe_command[1024];
+    struct stat st;
+    
+    int i;
+    
+    memset(cam, 0, sizeof(*cam));
+    cam->fd = -1;
+    
+    // Replay raw frames from a file or named pipe
+    if (stat(source, &st) == 0 && (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)))
+    {
+        fprintf(stderr, "Replaying camera frames from %s\n", source);
+        cam->pipe = fopen(source, "rb");
+        cam->is_file = S_ISREG(st.st_mode);
+    }
+    else
+    {
+#ifdef HAVE_V4L2
+        if (strncmp(source, "ffmpeg:", 7) != 0)
+        {
+            if (camera_open_v4l2(cam, source) == 0)
+            {
+                fprintf(stderr, "Capturing from %s with %d mmap buffers\n", source, cam->buffers);
+                return 0;
+            }
+            fprintf(stderr, "V4L2 capture from %s failed, falling back to ffmpeg\n", source);
+        }
+#endif
+        if (strncmp(source, "ffmpeg:", 7) == 0) source += 7;
+        snprintf(pipe_command, sizeof(pipe_command), "ffmpeg -video_size %dx%d -i %s -f image2pipe -vcodec rawvideo - < /dev/null", vw, vh, source);
+        fprintf(stderr, "Opening pipe:\n%s\n", pipe_command);
+        cam->pipe = popen(pipe_command, "r");
+    }
+    
+    if (cam->pipe == NULL)
+    {
+        fprintf(stderr, "Could not open camera source %s\n", source);
+        return -1;
+    }
+    cam->buffers = CAMERA_BUFFERS;
+    for (i=0 ; i<CAMERA_BUFFERS ; ++i) cam->buffer[i] = malloc(vh*vw*2);
+    return 0;
+}
+
+// Wait for the next frame. Returns a pointer to its pixels, which stay
+// valid (and may be modified) until the buffer *index is given back with
+// camera_release(), or NULL on failure. Only one thread may call this,
+// but buffers can be released from any thread.
+unsigned char *camera_frame(camera *cam, int *index)
+{
+    int i;
+    unsigned char *frame;
+    
+#ifdef HAVE_V4L2
+    if (cam->fd >= 0)
+    {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(cam->fd, VIDIOC_DQBUF, &buf) < 0)
+        {
+            fprintf(stderr, "VIDIOC_DQBUF failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        *index = buf.index;
+        if (buf.bytesused < vh*vw*2)
+        {
+            fprintf(stderr, "Short frame from camera (%u bytes)\n", buf.bytesused);
+            memset((unsigned char *)cam->buffer[buf.index] + buf.bytesused, 0, vh*vw*2 - buf.bytesused);
+        }
+        return cam->buffer[buf.index];
+    }
+#endif
+    
+    // Take a free buffer
+    for (i=0 ; i<CAMERA_BUFFERS && !SDL_AtomicCAS(&cam->busy[i], 0, 1) ; ++i);
+    if (i == CAMERA_BUFFERS)
+    {
+        fprintf(stderr, "No free camera buffer\n");
+        return NULL;
+    }
+    *index = i;
+    frame = cam->buffer[i];
+    
+    if (cam->is_file)
+    {
+        if ((Sint32)(cam->next_frame - SDL_GetTicks()) > 0) SDL_Delay(cam->next_frame - SDL_GetTicks());
+        cam->next_frame = SDL_GetTicks() + 33;
+    }
+    
+    if (fread(frame, 1, vh*vw*2, cam->pipe) != vh*vw*2)
+    {
+        // Loop a replay file from the start
+        if (!cam->is_file || fseek(cam->pipe, 0, SEEK_SET) != 0
+                || fread(frame, 1, vh*vw*2, cam->pipe) != vh*vw*2)
+        {
+            fprintf(stderr, "Got wrong number of bytes from camera\n");
+            SDL_AtomicSet(&cam->busy[i], 0);
+            return NULL;
+        }
+    }
+    return frame;
+}
+
+// Give a frame's buffer back to be filled again
+void camera_release(camera *cam, int index)
+{
+#ifdef HAVE_V4L2
+    if (cam->fd >= 0)
+    {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = index;
+        if (xioctl(cam->fd, VIDIOC_QBUF, &buf) < 0) fprintf(stderr, "VIDIOC_QBUF failed: %s\n", strerror(errno));
+        return;
+    }
+#endif
+    SDL_AtomicSet(&cam->busy[index], 0);
+}
+
+void camera_close(camera *cam)
+{
+    int i;
+    
+#ifdef HAVE_V4L2
+    if (cam->fd >= 0)
+    {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        xioctl(cam->fd, VIDIOC_STREAMOFF, &type);
+        for (i=0 ; i<cam->buffers ; ++i) munmap(cam->buffer[i], cam->length[i]);
+        close(cam->fd);
+        fprintf(stderr, "Closed camera\n");
+        return;
+    }
+#endif
+    if (cam->pipe && cam->is_file) fclose(cam->pipe);
+    else if (cam->pipe)
+    {
+        fprintf(stderr, "Closing camera pipe\n");
+        fprintf(stderr, "ffmpeg pipe exit value is %d\n", pclose(cam->pipe));
+    }
+    for (i=0 ; i<CAMERA_BUFFERS ; ++i) free(cam->buffer[i]);
+}
+
+//
+// The template screen runs as a pipeline of three stages: a capture
+// thread takes frames from the camera, a segmentation thread finds the
+// background colour range and classifies every pixel (and fills a
+// template from the frame when asked), and the main thread draws the
+// overlays and displays the result. The stages are connected by
+// single-producer single-consumer rings that hand over camera buffers.
+//
+// A slow stage does not hold up the others. Capture drops frames when the
+// segmentation ring is full, and segmentation and display always skip to
+// the newest frame in their ring, so the preview lags by roughly the time
+// of the slowest stage rather than the sum of all of them.
+//
+#define RING_SIZE 2
+
+typedef struct
+{
+    unsigned char (*vp)[vw][2]; // frame pixels (a camera buffer)
+    int index;                  // camera buffer index
+    Uint64 captured, segmented; // performance counter times
+} video_frame;
+
+typedef struct
+{
+    video_frame slot[RING_SIZE];
+    SDL_atomic_t head, tail; // head is only written by the producer, tail by the consumer
+    SDL_sem *ready;          // posted for every frame pushed
+} frame_ring;
+
+// Add a frame to the ring. Returns 0 if the ring is full.
+int ring_push(frame_ring *r, const video_frame *f)
+{
+    int head = SDL_AtomicGet(&r->head);
+    if (head - SDL_AtomicGet(&r->tail) == RING_SIZE) return 0;
+    r->slot[head % RING_SIZE] = *f;
+    SDL_AtomicSet(&r->head, head + 1);
+    SDL_SemPost(r->ready);
+    return 1;
+}
+
+// Take the oldest frame from the ring. Returns 0 if the ring is empty.
+int ring_pop(frame_ring *r, video_frame *f)
+{
+    int tail = SDL_AtomicGet(&r->tail);
+    if (tail == SDL_AtomicGet(&r->head)) return 0;
+    *f = r->slot[tail % RING_SIZE];
+    SDL_AtomicSet(&r->tail, tail + 1);
+    return 1;
+}
+
+// Segmentation settings, changed by the user on the main thread
+typedef struct
+{
+    int left, right, top, bottom; // analysis region
+    int tol;                      // colour matching tolerance
+    int exclude_lower_edge;       // calibrate background colour using top, left and right edges only
+} segment_settings;
+
+// Settings last used on the template screen, which live updates use too
+segment_settings template_region = {vw/4, 3*vw/4, vh/4, 3*vh/4, 20, 0};
+
+// Pipeline stages. The latency of a stage is measured from the end of
+// the previous stage, and the total latency from capture to display.
+enum {STAGE_CAPTURE, STAGE_SEGMENT, STAGE_DISPLAY, STAGES};
+
+struct
+{
+    camera cam;
+    frame_ring segment_ring, display_ring;
+    SDL_SpinLock lock;            // protects settings
+    segment_settings settings;
+    SDL_atomic_t update_template; // template to fill from the next frame, or -1
+    SDL_atomic_t quit, failed;
+    SDL_Thread *capture, *segment;
+    int live_template;            // template updated live from each frame, or -1
+    
+    int frames[STAGES];           // frames that completed each stage
+    int dropped[STAGES];          // frames dropped by each stage
+    double latency[STAGES+1], max_latency[STAGES+1]; // ms, per stage and total
+} video;
+
+// Record the latency from time start to now for a stage (or STAGES for the total)
+void record_latency(int stage, Uint64 start, Uint64 now)
+{
+    double ms = 1000.0 * (now - start) / SDL_GetPerformanceFrequency();
+    video.latency[stage] += ms;
+    if (ms > video.max_latency[stage]) video.max_latency[stage] = ms;
+}
+
+//
+// YUY2 kernels for the template screen. A row of a YUY2 frame holds pairs
+// of pixels as Y0 U Y1 V, so pixel vx has its own Y and shares U and V with
+// the other pixel of its pair. The SSE2 versions work on 8 pixels (4
+// pairs) at a time, with Y and chroma in alternate 16-bit lanes, and the
+// scalar versions handle the partial pairs at the ends of a range.
+//
+// A pixel is background if Y, U and V are all strictly inside the
+// background colour range lo..hi (indexed Y, U, V).
+//
+
+// Fixed-point YUV to RGB coefficients (scaled by 2^13)
+#define YUV_SHIFT 13
+#define YUV_CY 9535  // 1.164
+#define YUV_BU 16531 // 2.018
+#define YUV_GU 3203  // 0.391
+#define YUV_GV 6660  // 0.813
+#define YUV_RV 13074 // 1.596
+
+static inline int yuy2_background(int Y, int U, int V, const int lo[3], const int hi[3])
+{
+    return Y>lo[0] && Y<hi[0] && U>lo[1] && U<hi[1] && V>lo[2] && V<hi[2];
+}
+
+static inline unsigned char clamp_byte(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void yuy2_minmax_pixel(const unsigned char *row, int vx, int lo[3], int hi[3])
+{
+    int c, v[3] = {row[2*vx], row[2*(vx&~1)+1], row[2*(vx|1)+1]};
+    for (c=0 ; c<3 ; ++c)
+    {
+        if (v[c] < lo[c]) lo[c] = v[c];
+        if (v[c] > hi[c]) hi[c] = v[c];
+    }
+}
+
+// Widen the range lo..hi to include pixels x0 to x1-1 of a row
+void yuy2_minmax(const unsigned char *row, int x0, int x1, int lo[3], int hi[3])
+{
+    int vx = x0;
+    
+    // Partial pairs at the ends
+    if (x0 >= x1) return;
+    if (x0 & 1) yuy2_minmax_pixel(row, vx++, lo, hi);
+    if ((x1 & 1) && x1 > vx) yuy2_minmax_pixel(row, --x1, lo, hi);
+
+#ifdef __SSE2__
+    if (x1 - vx >= 8)
+    {
+        // Bytes of the channels we are not looking at are forced to 255
+        // for the minimum and 0 for the maximum
+        const __m128i ymask = _mm_set1_epi16(0x00ff), umask = _mm_set1_epi32(0x0000ff00), vmask = _mm_set1_epi32((int)0xff000000);
+        __m128i ymin = _mm_set1_epi8(-1), umin = ymin, vmin = ymin;
+        __m128i ymax = _mm_setzero_si128(), umax = ymax, vmax = ymax;
+        unsigned char bmin[3][16], bmax[3][16];
+        int i, c;
+        
+        for ( ; vx+8<=x1 ; vx+=8)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(row + 2*vx));
+            ymin = _mm_min_epu8(ymin, _mm_or_si128(p, _mm_andnot_si128(ymask, _mm_set1_epi8(-1))));
+            umin = _mm_min_epu8(umin, _mm_or_si128(p, _mm_andnot_si128(umask, _mm_set1_epi8(-1))));
+            vmin = _mm_min_epu8(vmin, _mm_or_si128(p, _mm_andnot_si128(vmask, _mm_set1_epi8(-1))));
+            ymax = _mm_max_epu8(ymax, _mm_and_si128(p, ymask));
+            umax = _mm_max_epu8(umax, _mm_and_si128(p, umask));
+            vmax = _mm_max_epu8(vmax, _mm_and_si128(p, vmask));
+        }
+        
+        _mm_storeu_si128((__m128i *)bmin[0], ymin); _mm_storeu_si128((__m128i *)bmax[0], ymax);
+        _mm_storeu_si128((__m128i *)bmin[1], umin); _mm_storeu_si128((__m128i *)bmax[1], umax);
+        _mm_storeu_si128((__m128i *)bmin[2], vmin); _mm_storeu_si128((__m128i *)bmax[2], vmax);
+        for (i=0 ; i<16 ; ++i)
+        {
+            c = (i & 1) == 0 ? 0 : (i & 3) == 1 ? 1 : 2; // Y, U or V byte
+            if (bmin[c][i] < lo[c]) lo[c] = bmin[c][i];
+            if (bmax[c][i] > hi[c]) hi[c] = bmax[c][i];
+        }
+    }
+#endif
+    
+    for ( ; vx<x1 ; ++vx) yuy2_minmax_pixel(row, vx, lo, hi);
+}
+
+// Set pixels x0 to x1-1 of a row to white if they are background or black
+// if not. All pixels are classified from the original values.
+void yuy2_classify_row(unsigned char *row, int x0, int x1, const int lo[3], const int hi[3])
+{
+    int vx, b0, b1;
+    
+    if (x0 >= x1) return;
+    
+    // A partial pair at either end uses the chroma of the pixel outside the
+    // range. Both are classified before anything is overwritten.
+    b0 = (x0 & 1) && yuy2_background(row[2*x0], row[2*x0-1], row[2*x0+1], lo, hi);
+    b1 = (x1 & 1) && yuy2_background(row[2*x1-2], row[2*x1-1], row[2*x1+1], lo, hi);
+    if (x0 & 1) {row[2*x0] = row[2*x0+1] = b0 ? 255 : 0; ++x0;}
+    if ((x1 & 1) && x1 > x0) {--x1; row[2*x1] = row[2*x1+1] = b1 ? 255 : 0;}
+    vx = x0;
+
+#ifdef __SSE2__
+    const __m128i byte = _mm_set1_epi16(0x00ff);
+    const __m128i ylo = _mm_set1_epi16(lo[0]), yhi = _mm_set1_epi16(hi[0]);
+    const __m128i clo = _mm_set_epi16(lo[2], lo[1], lo[2], lo[1], lo[2], lo[1], lo[2], lo[1]); // U in even lanes, V in odd
+    const __m128i chi = _mm_set_epi16(hi[2], hi[1], hi[2], hi[1], hi[2], hi[1], hi[2], hi[1]);
+    
+    for ( ; vx+8<=x1 ; vx+=8)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i *)(row + 2*vx));
+        __m128i y = _mm_and_si128(p, byte), c = _mm_srli_epi16(p, 8);
+        __m128i yin = _mm_and_si128(_mm_cmpgt_epi16(y, ylo), _mm_cmplt_epi16(y, yhi));
+        __m128i cin = _mm_and_si128(_mm_cmpgt_epi16(c, clo), _mm_cmplt_epi16(c, chi));
+        
+        // Both chroma values of a pair must be inside the range
+        cin = _mm_and_si128(cin, _mm_shufflehi_epi16(_mm_shufflelo_epi16(cin, _MM_SHUFFLE(2,3,0,1)), _MM_SHUFFLE(2,3,0,1)));
+        _mm_storeu_si128((__m128i *)(row + 2*vx), _mm_and_si128(yin, cin));
+    }
+#endif
+    
+    for ( ; vx<x1 ; vx+=2)
+    {
+        b0 = yuy2_background(row[2*vx], row[2*vx+1], row[2*vx+3], lo, hi);
+        b1 = yuy2_background(row[2*vx+2], row[2*vx+1], row[2*vx+3], lo, hi);
+        row[2*vx] = row[2*vx+1] = b0 ? 255 : 0;
+        row[2*vx+2] = row[2*vx+3] = b1 ? 255 : 0;
+    }
+}
+
+#ifdef __SSE2__
+// One colour channel of 8 texels as bytes: the Y terms plus the (U, V)
+// pairs times coef, shifted down and clamped to 0..255 by the packs
+static inline __m128i yuv_channel_sse2(__m128i ylo32, __m128i yhi32, __m128i uvlo, __m128i uvhi, __m128i coef)
+{
+    return _mm_packus_epi16(_mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(ylo32, _mm_madd_epi16(uvlo, coef)), YUV_SHIFT),
+            _mm_srai_epi32(_mm_add_epi32(yhi32, _mm_madd_epi16(uvhi, coef)), YUV_SHIFT)), _mm_setzero_si128());
+}
+#endif
+
+// Convert pixels column[0..count-1] of a row to ARGB texels, with alpha 0
+// for background and 255 for foreground
+void yuy2_to_template_row(const unsigned char *row, const int *column, int count, unsigned char *out, const int lo[3], const int hi[3])
+{
+    int k = 0, vx, Y, U, V, y;
+
+#ifdef __SSE2__
+    // Coefficients for (Y, 0) and (U, V) pairs of 16-bit lanes
+    const __m128i cy = _mm_set_epi16(0, YUV_CY, 0, YUV_CY, 0, YUV_CY, 0, YUV_CY);
+    const __m128i cb = _mm_set_epi16(0, YUV_BU, 0, YUV_BU, 0, YUV_BU, 0, YUV_BU);
+    const __m128i cg = _mm_set_epi16(-YUV_GV, -YUV_GU, -YUV_GV, -YUV_GU, -YUV_GV, -YUV_GU, -YUV_GV, -YUV_GU);
+    const __m128i cr = _mm_set_epi16(YUV_RV, 0, YUV_RV, 0, YUV_RV, 0, YUV_RV, 0);
+    const __m128i y16 = _mm_set1_epi16(16), c128 = _mm_set1_epi16(128);
+    const __m128i ylo = _mm_set1_epi16(lo[0]), yhi = _mm_set1_epi16(hi[0]);
+    const __m128i ulo = _mm_set1_epi16(lo[1]), uhi = _mm_set1_epi16(hi[1]);
+    const __m128i vlo = _mm_set1_epi16(lo[2]), vhi = _mm_set1_epi16(hi[2]);
+    const __m128i zero = _mm_setzero_si128();
+    Uint16 ys[8], us[8], vs[8];
+    int i;
+    
+    for ( ; k+8<=count ; k+=8)
+    {
+        // Fetch the samples, then convert 8 texels at once
+        for (i=0 ; i<8 ; ++i)
+        {
+            vx = column[k+i];
+            ys[i] = row[2*vx]; us[i] = row[2*(vx&~1)+1]; vs[i] = row[2*(vx|1)+1];
+        }
+        __m128i Yv = _mm_loadu_si128((const __m128i *)ys);
+        __m128i Uv = _mm_loadu_si128((const __m128i *)us);
+        __m128i Vv = _mm_loadu_si128((const __m128i *)vs);
+        
+        __m128i background = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(Yv, ylo), _mm_cmplt_epi16(Yv, yhi)),
+                _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi16(Uv, ulo), _mm_cmplt_epi16(Uv, uhi)),
+                              _mm_and_si128(_mm_cmpgt_epi16(Vv, vlo), _mm_cmplt_epi16(Vv, vhi))));
+        __m128i alpha = _mm_andnot_si128(background, _mm_set1_epi16(255));
+        
+        Yv = _mm_sub_epi16(Yv, y16); Uv = _mm_sub_epi16(Uv, c128); Vv = _mm_sub_epi16(Vv, c128);
+        __m128i ylo32 = _mm_madd_epi16(_mm_unpacklo_epi16(Yv, zero), cy), yhi32 = _mm_madd_epi16(_mm_unpackhi_epi16(Yv, zero), cy);
+        __m128i uvlo = _mm_unpacklo_epi16(Uv, Vv), uvhi = _mm_unpackhi_epi16(Uv, Vv);
+        
+        __m128i b = yuv_channel_sse2(ylo32, yhi32, uvlo, uvhi, cb);
+        __m128i g = yuv_channel_sse2(ylo32, yhi32, uvlo, uvhi, cg);
+        __m128i r = yuv_channel_sse2(ylo32, yhi32, uvlo, uvhi, cr);
+        __m128i a = _mm_packus_epi16(alpha, zero);
+        
+        __m128i bg = _mm_unpacklo_epi8(b, g), ra = _mm_unpacklo_epi8(r, a);
+        _mm_storeu_si128((__m128i *)(out + 4*k), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(out + 4*k + 16), _mm_unpackhi_epi16(bg, ra));
+    }
+#endif
+    
+    for ( ; k<count ; ++k)
+    {
+        vx = column[k];
+        Y = row[2*vx]; U = row[2*(vx&~1)+1]; V = row[2*(vx|1)+1];
+        y = YUV_CY*(Y-16);
+        out[4*k+0] = clamp_byte((y + YUV_BU*(U-128)) >> YUV_SHIFT);                    // blue
+        out[4*k+1] = clamp_byte((y - YUV_GU*(U-128) - YUV_GV*(V-128)) >> YUV_SHIFT);   // green
+        out[4*k+2] = clamp_byte((y + YUV_RV*(V-128)) >> YUV_SHIFT);                    // red
+        out[4*k+3] = yuy2_background(Y, U, V, lo, hi) ? 0 : 255;                       // alpha
+    }
+}
+
+// Find the background colour range lo..hi of a frame by scanning edge
+// pixels of the analysis region: two rows at the top and bottom and two
+// columns at each side
+void background_range(unsigned char (*vp)[vw][2], const segment_settings *s, int lo[3], int hi[3])
+{
+    int vy, c, edge_end;
+    int left = s->left, right = s->right, top = s->top, bottom = s->bottom;
+    
+    for (c=0 ; c<3 ; ++c)
+    {
+        lo[c] = 255;
+        hi[c] = 0;
+    }
+    
+    edge_end = bottom-(2*(1-s->exclude_lower_edge));
+    for (vy=top ; vy<bottom ; ++vy)
+    {
+        if (vy>=top+2 && vy<edge_end)
+        {
+            yuy2_minmax(vp[vy][0], left, left+2 < right ? left+2 : right, lo, hi);
+            yuy2_minmax(vp[vy][0], right-2 > left+2 ? right-2 : left+2, right, lo, hi);
+        }
+        else yuy2_minmax(vp[vy][0], left, right, lo, hi);
+    }
     
-    // Initialise templates with flat colours
-    for (y=0 ; y<TH ; ++y) for (x=0 ; x<TW ; ++x)
+    for (c=0 ; c<3 ; ++c)
     {
-        template[0][y][x][0] = 255; // blue
-        template[0][y][x][1] = 255; // green
-        template[0][y][x][2] = 255; // red
-        template[0][y][x][3] = 255; // alpha
-        template[1][y][x][0] = 0;   // blue     
-        template[1][y][x][1] = 0;   // green
-        template[1][y][x][2] = 0;   // red
-        template[1][y][x][3] = 255; // alpha
+        lo[c] -= s->tol;
+        hi[c] += s->tol;
     }
+}
+
+// Scale the analysis region of a frame to a template_w x template_h
+// template at out
+void frame_to_template(unsigned char (*vp)[vw][2], const segment_settings *s, const int lo[3], const int hi[3], unsigned char *out)
+{
+    int vy, ty, tx;
+    int *column = malloc(template_w*sizeof(int));
     
-    // Initialise SDL
-    if (SDL_Init(SDL_INIT_EVERYTHING) == -1)
+    for (tx=0 ; tx<template_w ; ++tx) column[tx] = s->left + (tx*1.0/template_w)*(s->right-s->left);
+    for (ty=0 ; ty<template_h ; ++ty)
     {
-        fprintf(stderr, "Failed to initialise SDL\n");
-        exit(1);
+        vy = s->top + (ty*1.0/template_h)*(s->bottom-s->top);
+        yuy2_to_template_row(vp[vy][0], column, template_w, out + 4*ty*template_w, lo, hi);
     }
+    free(column);
+}
+
+// Find the background colour range from the edge of the analysis region,
+// fill template n from the region if n is 0 or 1, then mark every pixel
+// of the region as background (white) or foreground (black)
+void segment_frame(unsigned char (*vp)[vw][2], const segment_settings *s, int n)
+{
+    int vy;
+    int lo[3], hi[3]; // Y, U, V
     
-    // Set up display. If a second screen is attached, use that.
-    // Otherwise, use the main screen.
-    int display_number = 0;
-    if (SDL_GetNumVideoDisplays() > 1) display_number = 1;
-    SDL_Rect displayRect;
-    SDL_GetDisplayBounds(display_number, &displayRect);
-    printf("Display %d: x=%d, y=%d, w=%d, h=%d\n", display_number, displayRect.x, displayRect.y, displayRect.w, displayRect.h);
-    
-    // Create SDL window and renderer
-    SDL_Window *sdlWindow;
-    SDL_Renderer *sdlRenderer;
-    sdlWindow = SDL_CreateWindow("Fraktalismus Window", displayRect.x, displayRect.y, displayRect.w, displayRect.h, SDL_WINDOW_FULLSCREEN_DESKTOP);
-    sdlRenderer = SDL_CreateRenderer(sdlWindow, 0, 0);
+    background_range(vp, s, lo, hi);
     
-    // Clear the new window
-    SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 255);
-    SDL_RenderClear(sdlRenderer);
-    SDL_RenderPresent(sdlRenderer);
+    // Update template if "1" or "2" was pressed (template 0 if "1" is pressed, template 1 if "2" is pressed)
+    if (n>=0)
+    {
+        fprintf(stderr, "Updating template %d\n", n);
+        frame_to_template(vp, s, lo, hi, TEMPLATE_PIXEL(n, 0, 0));
+        template_generation++;
+    }
     
-    // Create texture for frame
-    SDL_Texture *sdlTexture;
-    sdlTexture = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, W, H);
+    // Process this frame
+    for (vy=s->top ; vy<s->bottom ; ++vy) yuy2_classify_row(vp[vy][0], s->left, s->right, lo, hi);
+}
+
+// Build template n of the back buffer from the frame. The other template
+// is filled in by swap_templates on the main thread.
+void live_segment_frame(unsigned char (*vp)[vw][2], const segment_settings *s, int n)
+{
+    int lo[3], hi[3];
     
-    // Initialise time for measuring duration of frames
-    Uint32 lastTime, currentTime;
-    lastTime = SDL_GetTicks();
+    background_range(vp, s, lo, hi);
+    frame_to_template(vp, s, lo, hi, template_back + n*template_bytes/2);
+}
+
+// Draw mouse crosshairs and boundaries of analysis region
+void draw_overlay(unsigned char (*vp)[vw][2], int mouse_x, int mouse_y, const segment_settings *s)
+{
+    int vx, vy;
     
-    SDL_Event event;
-    while (!exiting)
+    for (vy=0 ; vy<vh ; ++vy)
     {
-        // Process any pending user input events
-        while (!exiting && SDL_PollEvent(&event))
-        {
-            if (event.type == SDL_KEYDOWN)
-            {
-                if (event.key.keysym.sym == SDLK_UP) scaling_factor /= 1.1;
-                else if (event.key.keysym.sym == SDLK_DOWN) scaling_factor *= 1.1;
-                else if (event.key.keysym.sym == SDLK_ESCAPE) exiting = 1;
-                else if (event.key.keysym.sym == SDLK_p) print_card(1); // Print hard copy
-                else if (event.key.keysym.sym == SDLK_s) print_card(0); // Only print to file
-                else if (event.key.keysym.sym == SDLK_i) invert_colour = 1 - invert_colour;
-                else if (event.key.keysym.sym == SDLK_r) reverse_template = 1 - reverse_template;
-                else if (event.key.keysym.sym == SDLK_q) exiting = 1;
-                else if (event.key.keysym.sym == SDLK_c) {colour_mode = (colour_mode + 1) % colour_modes; printf("Colour mode: %d\n", colour_mode);}
-                else if (event.key.keysym.sym == SDLK_f) {function_mode = (function_mode + 1) % function_modes; printf("Function mode: %d\n", function_mode);}
-                else if (event.key.keysym.sym == SDLK_u) update_template(sdlRenderer);
-            }
-        }
+        // crosshairs
+        vp[vy][mouse_x][0] = 0;
+        vp[vy][mouse_x][1] = 127;
         
-        // Get mouse position
-        SDL_GetMouseState(&x, &y);
-        a = b = c = d = 1;
+        // left and right boundaries of analysis region
+        vp[vy][s->left][0] = 255;
+        vp[vy][s->left][1] = 127;
+        vp[vy][s->right][0] = 255;
+        vp[vy][s->right][1] = 127;
+    }
+    
+    for (vx=0 ; vx<vw ; ++vx)
+    {
+        // crosshairs
+        vp[mouse_y][vx][0] = 0;
+        vp[mouse_y][vx][1] = 127;
         
-        if (function_mode == 0)
-        {
-            a = 1; b = 1;
-            c = scaling_factor * ((x - W/2) + (y - H/2)*I);
-            d = 0;
-        }
-        else if (function_mode == 1)
-        {
-            a = 1; b = 1;
-            c = scaling_factor * ((x - W/2) + (y - H/2)*I);
-            d = -0.625 - 0.4*I;
-        }
-        else if (function_mode == 2)
+        // top and bottom boundaries of analysis region
+        vp[s->top][vx][0] = 255;
+        vp[s->top][vx][1] = 127;
+        vp[s->bottom][vx][0] = 255;
+        vp[s->bottom][vx][1] = 127;
+    }
+}
+
+int capture_thread(void *data)
+{
+    video_frame f;
+    Uint64 start;
+    
+    while (!SDL_AtomicGet(&video.quit))
+    {
+        // Capture time includes waiting for the camera to deliver the frame
+        start = SDL_GetPerformanceCounter();
+        f.vp = (unsigned char (*)[vw][2])camera_frame(&video.cam, &f.index);
+        if (f.vp == NULL)
         {
-            a = 1;
-            b = c = scaling_factor * ((x - W/2) + (y - H/2)*I);
-            d = 0;
+            SDL_AtomicSet(&video.failed, 1);
+            break;
         }
-        else if (function_mode == 3)
+        f.captured = SDL_GetPerformanceCounter();
+        record_stage(METRIC_CAPTURE, start);
+        video.frames[STAGE_CAPTURE]++;
+        
+        if (!ring_push(&video.segment_ring, &f))
         {
-            a = 1;
-            b = 0;
-            c = scaling_factor * ((x - W/2) + (y - H/2)*I);
-            d = 1;
+            camera_release(&video.cam, f.index);
+            video.dropped[STAGE_CAPTURE]++;
         }
-        
-        // Generate fractal
-        generate_fractal(p, W, H, scaling_factor, 0, a, b, c, d, colour_mode, invert_colour, reverse_template);
-        
-        // Draw fractal image
-        SDL_UpdateTexture(sdlTexture, NULL, p, W * sizeof(Uint32));
-        SDL_RenderClear(sdlRenderer);
-        SDL_RenderCopy(sdlRenderer, sdlTexture, NULL, NULL);
-        SDL_RenderPresent(sdlRenderer);
-        
-        // Measure frame time
-        currentTime = SDL_GetTicks();
-        printf("Frame time: %d ms\n", currentTime - lastTime);
-        lastTime = currentTime;
     }
-    
-    // Destroy SDL objects
-    SDL_DestroyTexture(sdlTexture);
-    SDL_DestroyRenderer(sdlRenderer);
-    SDL_DestroyWindow(sdlWindow);
-
-    // Close SDL
-    SDL_Quit();
-    
     return 0;
 }
 
-void generate_fractal(Uint32 *p, int w, int h, double px, complex double centre, complex double a, complex double b, complex double c, complex double d, int cmode, int invert_colour, int reverse_template)
+int segment_thread(void *data)
 {
-    int n, x, y;
-    complex double z, zz;
-    Uint32 tx, ty, tn, txx, tyy;
-    unsigned char red, green, blue, alpha;
-
-    Uint32 start_time, timeout = 5000;
-    start_time = SDL_GetTicks();
+    video_frame f, newer;
+    segment_settings s;
+    Uint64 start;
     
-    // Generate fractal image
-    for (y=0 ; y<=h/2 ; ++y) for (x=0 ; x<w ; ++x)
+    while (!SDL_AtomicGet(&video.quit) && !SDL_AtomicGet(&video.failed))
     {
-        if ((SDL_GetTicks() - start_time) > timeout) return;
-        
-        z = px * ((x-w/2) + I*(y-h/2));
+        SDL_SemWaitTimeout(video.segment_ring.ready, 100);
+        if (!ring_pop(&video.segment_ring, &f)) continue;
         
-        for (n=0 ; n<25 ; ++n)
+        // Skip to the newest frame
+        while (ring_pop(&video.segment_ring, &newer))
         {
-            // Find template coordinates
-            txx = TW*(0.5 + 0.25*creal(z));
-            tx = txx & 1023;
-            tyy = TH*(0.5 + 0.25*cimag(z));
-            ty = tyy & 1023;
-            tn = ((txx >> 10)+(tyy >> 10))%2;
-            if ((tx!=txx || ty!=tyy) && n > 1)
-            {
-                if (reverse_template == 1 && template[tn][ty][tx][3] < 127) break;
-                if (reverse_template == 0 && template[tn][ty][tx][3] > 127) break;
-            }
-            
-            // Iterate z
-            zz = z*z;
-            z = (a*zz + c)/(b*zz + d);
+            camera_release(&video.cam, f.index);
+            video.dropped[STAGE_SEGMENT]++;
+            f = newer;
         }
         
-        // Colour mapping
-        alpha = 255;
-        red = green = blue = 0;
-        
+        SDL_AtomicLock(&video.lock);
+        s = video.settings;
+        SDL_AtomicUnlock(&video.lock);
         
-        if (cmode == 0)
-        {
-            blue = n < 10 ? 25*n : 255;
-            red = n<10 ? 0 : 255*(n-10.0)/15.0;
-            green = red;
-        }
-        else if (cmode == 1)
-        {
-            red = green = blue = 255;
-            if ((n+0)%3 == 0) {red = 10*n;}
-            if ((n+1)%3 == 0) {green = 10*n;}
-            if ((n+2)%3 == 0) {blue = 10*n;}
-        }
-        else if (cmode == 2)
-        {
-            red = green = blue = 255;
-            if (n%2) red = green = 10*n;
-            else blue = 10*n;
-        }
-        else if (cmode == 3)
-        {
-            red = green = blue = 10*n;
-        }
-        else if (cmode == 4)
+        // In live mode, frames become templates rather than being displayed.
+        // Frames that arrive while the main loop has yet to take the last
+        // templates are dropped.
+        if (video.live_template >= 0)
         {
-            red   = template[tn][ty][tx][2] + (n/25.0)*(255-template[tn][ty][tx][2]);
-            green = template[tn][ty][tx][1] + (n/25.0)*(255-template[tn][ty][tx][1]);
-            blue  = template[tn][ty][tx][0] + (n/25.0)*(255-template[tn][ty][tx][0]);
+            if (SDL_AtomicGet(&template_back_ready)) video.dropped[STAGE_SEGMENT]++;
+            else
+            {
+                start = SDL_GetPerformanceCounter();
+                live_segment_frame(f.vp, &s, video.live_template);
+                record_stage(METRIC_SEGMENT, start);
+                SDL_AtomicSet(&template_back_ready, 1);
+                record_latency(STAGE_SEGMENT, f.captured, SDL_GetPerformanceCounter());
+                video.frames[STAGE_SEGMENT]++;
+            }
+            camera_release(&video.cam, f.index);
+            continue;
         }
         
-        // Invert colour if selected
-        if (invert_colour)
+        start = SDL_GetPerformanceCounter();
+        segment_frame(f.vp, &s, SDL_AtomicSet(&video.update_template, -1));
+        f.segmented = SDL_GetPerformanceCounter();
+        record_stage(METRIC_SEGMENT, start);
+        record_latency(STAGE_SEGMENT, f.captured, f.segmented);
+        video.frames[STAGE_SEGMENT]++;
+        
+        if (!ring_push(&video.display_ring, &f))
         {
-            red = 255 - red;
-            green = 255 - green;
-            blue = 255 - blue;
+            camera_release(&video.cam, f.index);
+            video.dropped[STAGE_SEGMENT]++;
         }
-
-        p[y*w+x] = (alpha<<24)+(red<<16)+(green<<8)+blue;
-        
-        if (y>0) p[(H-y)*W+(W-1-x)] = p[y*W+x];
-    }
-    
-    // Colour correction for centre points
-    if (d==0)
-    {
-        y = h/2; x = w/2;
-        p[y*w+x-1] = p[(y+1)*w+x-1];
-        p[y*w+x]   = p[(y+1)*w+x];
     }
+    return 0;
 }
 
-void print_card(int print_hard_copy)
+// Open the camera and start the capture and segmentation stages. With
+// live >= 0, segmented frames update template live in the back buffer
+// instead of going to the display ring. Returns -1 if the camera could
+// not be opened.
+int start_video(int live)
 {
-	// Check if "prints" directory exists. If not, create it.
-	struct stat statstruct = {0};
-	stat("prints", &statstruct);
-	if (statstruct.st_mode & S_IFDIR) fprintf(stderr, "prints directory exists\n");
-	else
-	{
-		fprintf(stderr, "Creating 'prints' directory...");
-		mkdir("prints", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-		fprintf(stderr, "Done\n");
-	}
-  
-	// Render date and time as string for filename of postscript file
-    char filename[1024];
-    time_t rawtime;
-    struct tm t;
-    time(&rawtime);
-    localtime_r(&rawtime, &t);
-    sprintf(filename, "prints/%04d_%02d_%02d_%02d-%02d-%02d.ps",
-                1900 + t.tm_year, t.tm_mon, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
-    fprintf(stderr, "%s\n", filename);
-    
-    // A4 width and height in points, from GhostView manual:
-    const double page_width = 595;
-    const double page_height = 842;
-    const double page_margin = 20.0;
-
-    // Create cairo surface and context
-    cairo_surface_t* ps_surface = cairo_ps_surface_create(filename, page_width, page_height);
-    cairo_t *cr = cairo_create(ps_surface);
-
-    // Copy fractal image to cairo surface
-    int rowstride, y;
-    cairo_surface_t *fractal_surface;
-    fractal_surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, W, H);
-    rowstride = cairo_image_surface_get_stride (fractal_surface);
-    unsigned char *surface_pixels = cairo_image_surface_get_data (fractal_surface);
-    for (y=0 ; y<H ; ++y) memcpy(surface_pixels+(y*rowstride), p+(y*W), W*4);
-    cairo_surface_mark_dirty (fractal_surface);
-
-    cairo_rectangle(cr, page_margin, page_margin, page_width-2.0*page_margin, 0.5*page_height - 2*page_margin);
-    cairo_clip(cr);
-    cairo_new_path(cr); // path "not consumed by clip", as it said in the example code!
-    cairo_translate(cr, page_width/2.0, page_height/4.0);
-    cairo_scale(cr, (0.5*page_height-2.0*page_margin)/H, (0.5*page_height-2.0*page_margin)/H);
-    cairo_translate(cr, -W/2, -H/2);
-    cairo_set_source_surface (cr, fractal_surface, 0, 0);
-    cairo_paint (cr);
+    memset(&video, 0, sizeof(video));
+    if (camera_open(&video.cam, camera_source) < 0) return -1;
     
-    // Draw frame if required
-    const int draw_frame = 0;
-    if (draw_frame)
-    {
-        cairo_identity_matrix (cr);
-        cairo_reset_clip(cr);
-        cairo_set_source_rgb (cr, 0.0, 0.0, 0.0);
-        cairo_set_line_width(cr, 3.0);
-        cairo_rectangle(cr, page_margin, page_margin, page_width-2.0*page_margin, 0.5*page_height - 2.0*page_margin);
-        cairo_stroke(cr);
-        cairo_set_source_rgb (cr, 1.0, 1.0, 1.0);
-        cairo_set_line_width(cr, 1.0);
-        cairo_rectangle(cr, page_margin, page_margin, page_width-2.0*page_margin, 0.5*page_height - 2.0*page_margin);
-        cairo_stroke(cr);
-    }
+    video.segment_ring.ready = SDL_CreateSemaphore(0);
+    video.display_ring.ready = SDL_CreateSemaphore(0);
+    video.settings = template_region;
+    video.live_template = live;
+    SDL_AtomicSet(&video.update_template, -1);
+    SDL_AtomicSet(&template_back_ready, 0);
+    video.capture = SDL_CreateThread(capture_thread, "capture", NULL);
+    video.segment = SDL_CreateThread(segment_thread, "segment", NULL);
+    return 0;
+}
 
-    // Draw back of card
-    cairo_identity_matrix (cr);
-    cairo_reset_clip (cr);
-    cairo_surface_t *rear_surface = cairo_image_surface_create_from_png ("cardback.png");
-    double png_height = cairo_image_surface_get_height (rear_surface);
-    double png_width = cairo_image_surface_get_width (rear_surface);
-    fprintf(stderr, "PNG width and height: %lf x %lf\n", png_width, png_height);
-    cairo_scale (cr, page_width / png_width, page_width / png_width);
-    cairo_translate (cr, 0, png_height);
-    cairo_set_source_surface (cr, rear_surface, 0, 0);
-    cairo_paint (cr);
-    cairo_surface_destroy(rear_surface);
+// Stop the pipeline, return any frames still in it to the camera, close
+// the camera and print the pipeline statistics
+void stop_video()
+{
+    video_frame f;
+    int stage;
     
-    // Draw templates on back of card
-    int template_size = 60; 
+    SDL_AtomicSet(&video.quit, 1);
+    SDL_WaitThread(video.capture, NULL);
+    SDL_WaitThread(video.segment, NULL);
+    while (ring_pop(&video.segment_ring, &f)) camera_release(&video.cam, f.index);
+    while (ring_pop(&video.display_ring, &f)) camera_release(&video.cam, f.index);
+    SDL_DestroySemaphore(video.segment_ring.ready);
+    SDL_DestroySemaphore(video.display_ring.ready);
+    SDL_AtomicSet(&template_back_ready, 0);
     
-    // Print template 0 in lower left corner of rear side of card
-    cairo_surface_t *template_surface0; 
-    template_surface0 = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, TW, TH);
-    rowstride = cairo_image_surface_get_stride (template_surface0);
-    surface_pixels = cairo_image_surface_get_data (template_surface0);
-    for (y=0 ; y<TH ; ++y) memcpy(surface_pixels+(y*rowstride), &(template[0][y][0][0]), TW*4);
-    cairo_surface_mark_dirty (template_surface0);
-    cairo_identity_matrix (cr);
-    cairo_reset_clip (cr);
-    cairo_translate(cr, page_margin, page_height-page_margin-template_size);
-    cairo_scale(cr, template_size*1.0/TW, template_size*1.0/TH);
-    cairo_set_source_surface (cr, template_surface0, 0, 0);
-    cairo_paint (cr);
+    camera_close(&video.cam);
     
-    // Print template 1 in lower right corner of rear side of card
-    cairo_surface_t *template_surface1; 
-    template_surface1 = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, TW, TH);
-    rowstride = cairo_image_surface_get_stride (template_surface1);
-    surface_pixels = cairo_image_surface_get_data (template_surface1);
-    for (y=0 ; y<TH ; ++y) memcpy(surface_pixels+(y*rowstride), &(template[1][y][0][0]), TW*4);
-    cairo_surface_mark_dirty (template_surface1);
-    cairo_identity_matrix (cr);
-    cairo_reset_clip (cr);
-    cairo_translate(cr, page_width-page_margin-template_size, page_height-page_margin-template_size);
-    cairo_scale(cr, template_size*1.0/TW, template_size*1.0/TH);
-    cairo_set_source_surface (cr, template_surface1, 0, 0);
-    cairo_paint (cr);
+    fprintf(stderr, "Video: %d frames captured, %d segmented, %d displayed; dropped %d at capture, %d at segmentation, %d at display\n",
+            video.frames[STAGE_CAPTURE], video.frames[STAGE_SEGMENT], video.frames[STAGE_DISPLAY],
+            video.dropped[STAGE_CAPTURE], video.dropped[STAGE_SEGMENT], video.dropped[STAGE_DISPLAY]);
+    for (stage=STAGE_SEGMENT ; stage<=STAGES ; ++stage)
+    {
+        if (video.live_template >= 0 && stage != STAGE_SEGMENT) continue;
+        fprintf(stderr, "  %s latency: average %.1f ms, maximum %.1f ms\n",
+                stage == STAGE_SEGMENT ? "Segmentation" : stage == STAGE_DISPLAY ? "Display" : "Total",
+                video.latency[stage] / (video.frames[stage < STAGES ? stage : STAGE_DISPLAY] + 1e-9), video.max_latency[stage]);
+    }
+}
 
-    // Finish drawing and destroy cairo surface and context
-    cairo_show_page(cr);
-    cairo_destroy(cr);
-    cairo_surface_destroy(template_surface0);
-    cairo_surface_destroy(template_surface1);
-    cairo_surface_destroy(fractal_surface);
-    cairo_surface_flush(ps_surface);
-    cairo_surface_destroy(ps_surface);
+// Template updated live from the camera while the fractal is displayed,
+// or -1 when live updates are off
+int live_template = -1;
 
-    // Print the file
-    if (print_hard_copy) cupsPrintFile(cupsGetDefault(), filename, "cairo PS", 0, NULL);
+// Start updating template n live (0 or 1), or stop live updates if n is -1
+void set_live_template(int n)
+{
+    if (live_template >= 0) stop_video();
+    live_template = -1;
     
-    // Make a copy of the output file for debugging
-    char command[1024];
-    sprintf(command, "cp %s aaa.ps", filename);
-    if (system(command)) fprintf(stderr, "Error copying file to aaa.ps\n");
+    if (n >= 0 && start_video(n) == 0) live_template = n;
+    fprintf(stderr, live_template >= 0 ? "Live template: %d\n" : "Live template: off\n", live_template + 1);
 }
 
-// Video frame pixels
-#define vw 1280
-#define vh 720
-unsigned char vp[vh][vw][2];
+// Return 1 if new live templates are waiting in the back buffer. The
+// caller swaps them in and clears template_back_ready, after which the
+// next templates are built. Stops live updates if the camera has failed.
+int live_template_ready()
+{
+    if (SDL_AtomicGet(&video.failed))
+    {
+        fprintf(stderr, "Camera failed\n");
+        set_live_template(-1);
+        return 0;
+    }
+    return SDL_AtomicGet(&template_back_ready);
+}
 
 void update_template(SDL_Renderer *sdlRenderer)
 {
     int mouse_x=0, mouse_y=0;
     int x1, y1, x2, y2, left, right, top, bottom;
-    x1 = left = vw/4;
-    x2 = right = 3*vw/4;
-    y1 = top = vh/4;
-    y2 = bottom = 3*vh/4;
+    x1 = left = template_region.left;
+    x2 = right = template_region.right;
+    y1 = top = template_region.top;
+    y2 = bottom = template_region.bottom;
+    
+    int tol = template_region.tol; // colour matching tolerance. 20 is default value, but can be adjusted while running.
+    int exclude_lower_edge = template_region.exclude_lower_edge; // calibrate background colour using top, left and right edges of analysis region only
     
-    static int tol = 20; // colour matching tolerance. 20 is default value, but can be adjusted while running.
-    static int exclude_lower_edge = 0; // calibrate background colour using top, left and right edges of analysis region only
-
-    int n = -1; // The number of the template to be updated. Setting this to 0 or 1 causes one of the templates to be updated.
     int exiting_video=0;
-    int byte_count;
-    int vx, vy, tx, ty;
-
+    Uint64 now;
+    segment_settings s = template_region;
+    video_frame f, newer;
+    
     // Open SDL window for video
     SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 255);
     SDL_RenderClear(sdlRenderer);
@@ -444,12 +5422,12 @@ void update_template(SDL_Renderer *sdlRenderer)
     video_rect.w = vw;
     video_rect.h = vh;
     
-    // Open camera via pipe
-    fprintf(stderr, "Opening camera via pipe\n");
-    char pipe_command[1024];
-    sprintf(pipe_command, "ffmpeg -video_size %dx%d -i /dev/video1 -f image2pipe -vcodec rawvideo - < /dev/null", vw, vh);
-    fprintf(stderr, "Opening pipe:\n%s\n", pipe_command);
-    FILE *cam = popen(pipe_command, "r");
+    // Open camera and start the capture and segmentation stages
+    if (start_video(-1) < 0)
+    {
+        SDL_DestroyTexture(video_texture);
+        return;
+    }
     
     while (!exiting_video)
     {
@@ -462,8 +5440,8 @@ void update_template(SDL_Renderer *sdlRenderer)
                 else if (event.key.keysym.sym == SDLK_DOWN) tol -= 1;
                 else if (event.key.keysym.sym == SDLK_ESCAPE) exiting_video = 1;
                 else if (event.key.keysym.sym == SDLK_q) exiting_video = 1;
-                else if (event.key.keysym.sym == SDLK_1) n = 0;
-                else if (event.key.keysym.sym == SDLK_2) n = 1;
+                else if (event.key.keysym.sym == SDLK_1) SDL_AtomicSet(&video.update_template, 0);
+                else if (event.key.keysym.sym == SDLK_2) SDL_AtomicSet(&video.update_template, 1);
                 else if (event.key.keysym.sym == SDLK_e) exclude_lower_edge = 1 - exclude_lower_edge;
             }
             else if (event.type == SDL_MOUSEBUTTONDOWN)
@@ -489,6 +5467,14 @@ void update_template(SDL_Renderer *sdlRenderer)
                 fprintf(stderr, "tol = %d, exclude_lower_edge = %d\n", tol, exclude_lower_edge);
             }
             
+            // Keep everything inside the video frame
+            if (mouse_x >= vw) mouse_x = vw-1;
+            if (mouse_y >= vh) mouse_y = vh-1;
+            if (x1 >= vw) x1 = vw-1;
+            if (x2 >= vw) x2 = vw-1;
+            if (y1 >= vh) y1 = vh-1;
+            if (y2 >= vh) y2 = vh-1;
+            
             // Set boundaries
             left   = x1 < x2 ? x1 : x2;
             right  = x1 < x2 ? x2 : x1;
@@ -496,138 +5482,49 @@ void update_template(SDL_Renderer *sdlRenderer)
             bottom = y1 < y2 ? y2 : y1;
         }
         
-        // Read a YUY2 frame from the input pipe into the buffer
-        byte_count = fread(vp, 1, vh*vw*2, cam);
-        if (byte_count != vh*vw*2)
-        {
-            fprintf(stderr, "Got wrong number of bytes from pipe. Exiting video...\n");
-            return;
-        }
-        
-        // Scan edge pixels to identify background colour range
-        int Y, U, V, red, green, blue;
-        int Ymin=255, Ymax=0;
-        int Umin=255, Umax=0;
-        int Vmin=255, Vmax=0;
-        
-        for (vy=top ; vy<bottom ; ++vy) for (vx=left ; vx<right ; ++vx)
-        {
-            if (vx==left+2 && vy>=top+2 && vy<bottom-(2*(1-exclude_lower_edge))) vx = right-2;
-            
-            Y = vp[vy][vx][0];
-            U = (vx%2) ? vp[vy][vx-1][1] : vp[vy][vx][1];
-            V = (vx%2) ? vp[vy][vx][1] : vp[vy][vx+1][1];
-            
-            if (Y<Ymin) Ymin = Y;
-            if (Y>Ymax) Ymax = Y;
-            if (U<Umin) Umin = U;
-            if (U>Umax) Umax = U;
-            if (V<Vmin) Vmin = V;
-            if (V>Vmax) Vmax = V;
-        }
-
-        Ymin-=tol; Ymax+=tol;
-        Umin-=tol; Umax+=tol;
-        Vmin-=tol; Vmax+=tol;
-        
-        // Update template if "1" or "2" was pressed (template 0 if "1" is pressed, template 1 if "2" is pressed)
-        if (n>=0)
-        {
-            fprintf(stderr, "Updating template %d\n", n);
-            
-            for (ty=0 ; ty<TH ; ++ty) for (tx=0 ; tx<TW ; ++tx)
-            {
-                vx = left + (tx*1.0/TW)*(right-left);
-                vy = top + (ty*1.0/TH)*(bottom-top);
-                
-                Y = vp[vy][vx][0];
-                U = (vx%2) ? vp[vy][vx-1][1] : vp[vy][vx][1];
-                V = (vx%2) ? vp[vy][vx][1] : vp[vy][vx+1][1];
-                
-                blue = 1.164*(Y-16) + 2.018*(U-128);
-                if (blue < 0) blue = 0;
-                if (blue > 255) blue = 255;
-                green = 1.164*(Y-16) - 0.813*(V-128) - 0.391*(U-128);
-                if (green < 0) green = 0;
-                if (green > 255) green = 255;
-                red = 1.164*(Y-16) + 1.596*(V-128);
-                if (red < 0) red = 0;
-                if (red > 255) red = 255;
-                
-                template[n][ty][tx][2] = red;
-                template[n][ty][tx][1] = green;
-                template[n][ty][tx][0] = blue;
-                
-                if (Y>Ymin && Y<Ymax && U>Umin && U<Umax && V>Vmin && V<Vmax)
-                {
-                    template[n][ty][tx][3] = 0;
-                }
-                else
-                {
-                    template[n][ty][tx][3] = 255;
-                }
-            }
-                
-            n = -1; // reset flag
-        }
+        // Pass the settings to the segmentation stage
+        s = (segment_settings){left, right, top, bottom, tol, exclude_lower_edge};
+        SDL_AtomicLock(&video.lock);
+        video.settings = s;
+        SDL_AtomicUnlock(&video.lock);
         
-        // Process this frame
-        for (vy=top ; vy<bottom ; ++vy) for (vx=left ; vx<right ; ++vx)
+        if (SDL_AtomicGet(&video.failed))
         {
-            Y = vp[vy][vx][0];
-            U = (vx%2) ? vp[vy][vx-1][1] : vp[vy][vx][1];
-            V = (vx%2) ? vp[vy][vx][1] : vp[vy][vx+1][1];
-            
-            if (Y>Ymin && Y<Ymax && U>Umin && U<Umax && V>Vmin && V<Vmax)
-            {
-                vp[vy][vx][0] = 255;
-                vp[vy][vx][1] = 255;
-            }
-            else
-            {
-                vp[vy][vx][0] = 0;
-                vp[vy][vx][1] = 0;
-            }
+            fprintf(stderr, "Exiting video...\n");
+            break;
         }
         
-        // Draw mouse crosshairs and boundaries of analysis region
-        for (vy=0 ; vy<vh ; ++vy)
+        // Show the newest segmented frame, if there is one
+        if (!ring_pop(&video.display_ring, &f))
         {
-            // crosshairs
-            vp[vy][mouse_x][0] = 0;
-            vp[vy][mouse_x][1] = 127;
-            
-            // left and right boundaries of analysis region
-            vp[vy][left][0] = 255;
-            vp[vy][left][1] = 127;
-            vp[vy][right][0] = 255;
-            vp[vy][right][1] = 127;
+            SDL_SemWaitTimeout(video.display_ring.ready, 10);
+            continue;
         }
-        
-        for (vx=0 ; vx<vw ; ++vx)
+        while (ring_pop(&video.display_ring, &newer))
         {
-            // crosshairs
-            vp[mouse_y][vx][0] = 0;
-            vp[mouse_y][vx][1] = 127;
-            
-            // top and bottom boundaries of analysis region
-            vp[top][vx][0] = 255;
-            vp[top][vx][1] = 127;
-            vp[bottom][vx][0] = 255;
-            vp[bottom][vx][1] = 127;
+            camera_release(&video.cam, f.index);
+            video.dropped[STAGE_DISPLAY]++;
+            f = newer;
         }
         
-        // Draw frame
-        SDL_UpdateTexture(video_texture, NULL, vp, vw*2);
+        // Draw frame, then give its buffer back to the camera
+        draw_overlay(f.vp, mouse_x, mouse_y, &s);
+        SDL_UpdateTexture(video_texture, NULL, f.vp, vw*2);
+        camera_release(&video.cam, f.index);
         SDL_RenderClear(sdlRenderer);
         SDL_RenderCopy(sdlRenderer, video_texture, NULL, &video_rect);
         SDL_RenderPresent(sdlRenderer);
+        
+        now = SDL_GetPerformanceCounter();
+        record_latency(STAGE_DISPLAY, f.segmented, now);
+        record_latency(STAGES, f.captured, now);
+        video.frames[STAGE_DISPLAY]++;
     }
     
-    // Close camera pipe
-    fprintf(stderr, "Closing camera pipe\n");
-    fflush(cam);
-    fprintf(stderr, "ffmpeg pipe exit value is %d\n", pclose(cam));
+    // Stop the pipeline and close camera, keeping the settings for next
+    // time and for live updates
+    stop_video();
+    template_region = s;
     
     // Destroy video-related SDL objects
     SDL_DestroyTexture(video_texture);